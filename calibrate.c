@@ -0,0 +1,217 @@
+/*
+ * Copyright (c) 2017 SUSE LLC
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "main.h"
+#include "calibrate.h"
+#include "usbhiddev.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* measures the whole loop from a key press on the hid gadget over the
+ * target drawing it and the extender encoding it to the change showing up
+ * in our framebuffer. The user focuses a text field on the target and
+ * passes the area where typed characters appear, we alternately type a
+ * character and delete it again and time until the area changed in the
+ * decoded picture compared to the last one before the key press. A
+ * blinking cursor in the area makes for early hits, better turn it off. */
+
+#define CALIBRATE_ROUNDS 20
+#define CALIBRATE_SETTLE 500000
+#define CALIBRATE_TIMEOUT 2000000
+#define CALIBRATE_STARTUP 10000000
+#define CALIBRATE_PIXEL_DIFF 48
+#define CALIBRATE_MIN_PIXELS 8
+
+static int x, y, w, h;
+static volatile int active;
+static int frames;
+static int64_t sent_at, seen_at;
+/* luma of the area in the latest frame and before the key press */
+static uint8_t *cur, *ref;
+static int area_size, have_ref;
+static pthread_mutex_t calibrate_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t calibrate_cond;
+
+static int64_t now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static void wait_until(int64_t t)
+{
+    struct timespec ts = { t / 1000000, (t % 1000000) * 1000 };
+    pthread_cond_timedwait(&calibrate_cond, &calibrate_lock, &ts);
+}
+
+static int cmp_latency(const void* a, const void* b)
+{
+    int64_t d = *(const int64_t*)a - *(const int64_t*)b;
+    return d < 0 ? -1 : d > 0;
+}
+
+/* x,y,w,h in framebuffer coordinates, the whole screen if not given */
+int calibrate_set_region(const char* arg)
+{
+    if (!arg) {
+	x = y = 0;
+	w = rfbScreen->width;
+	h = rfbScreen->height;
+	return 0;
+    }
+    if (sscanf(arg, "%d,%d,%d,%d", &x, &y, &w, &h) != 4
+	    || w <= 0 || h <= 0 || x < 0 || y < 0
+	    || x + w > rfbScreen->width || y + h > rfbScreen->height) {
+	fprintf(stderr, "invalid calibration area %s\n", arg);
+	return -1;
+    }
+    return 0;
+}
+
+int calibrate_area(int* ax, int* ay, int* aw, int* ah)
+{
+    *ax = x;
+    *ay = y;
+    *aw = w;
+    *ah = h;
+    return active;
+}
+
+/* enough pixels changed clearly, compression noise doesn't get there */
+static int area_changed(const uint8_t* a, const uint8_t* b, int n)
+{
+    int i, count = 0;
+
+    for (i = 0; i < n && count < CALIBRATE_MIN_PIXELS; ++i)
+	count += abs(a[i] - b[i]) > CALIBRATE_PIXEL_DIFF;
+    return count >= CALIBRATE_MIN_PIXELS;
+}
+
+/* called by the capture thread with the luma of the area in every decoded
+ * frame, key frame or not, so neither the gop length nor the jitter
+ * buffer or noise filter end up in the numbers */
+void calibrate_frame(const uint8_t* luma, int linesize, int fw, int fh)
+{
+    int row;
+
+    pthread_mutex_lock(&calibrate_lock);
+    if (fw * fh != area_size) {
+	free(cur);
+	free(ref);
+	cur = malloc(fw * fh);
+	ref = calloc(1, fw * fh);
+	area_size = cur && ref ? fw * fh : 0;
+	have_ref = 0;
+    }
+    if (area_size) {
+	for (row = 0; row < fh; ++row)
+	    memcpy(cur + row * fw, luma + row * linesize, fw);
+	++frames;
+	if (sent_at && !seen_at && have_ref && area_changed(cur, ref, area_size)) {
+	    seen_at = now_us();
+	    pthread_cond_signal(&calibrate_cond);
+	}
+    }
+    pthread_mutex_unlock(&calibrate_lock);
+}
+
+int calibrate_run()
+{
+    static const rfbKeySym keys[] = { XK_a, XK_BackSpace };
+    int64_t latency[CALIBRATE_ROUNDS];
+    int64_t deadline;
+    int i, n = 0;
+
+    {
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&calibrate_cond, &attr);
+	pthread_condattr_destroy(&attr);
+    }
+
+    fprintf(stderr, "calibrating on %dx%d+%d+%d\n", w, h, x, y);
+    active = 1;
+    video_hold_capture();
+
+    pthread_mutex_lock(&calibrate_lock);
+    deadline = now_us() + CALIBRATE_STARTUP;
+    while (!frames && now_us() < deadline)
+	wait_until(deadline);
+    if (!frames) {
+	pthread_mutex_unlock(&calibrate_lock);
+	fputs("no video in a planar yuv format, giving up\n", stderr);
+	goto out;
+    }
+
+    for (i = 0; i < CALIBRATE_ROUNDS; ++i) {
+	/* let the previous change and anything it triggered pass */
+	sent_at = 0;
+	deadline = now_us() + CALIBRATE_SETTLE;
+	while (now_us() < deadline)
+	    wait_until(deadline);
+
+	seen_at = 0;
+	if (area_size)
+	    memcpy(ref, cur, area_size);
+	have_ref = 1;
+	sent_at = now_us();
+	pthread_mutex_unlock(&calibrate_lock);
+
+	usbhid_handle_key(TRUE, keys[i % DIMOF(keys)], NULL);
+	usbhid_handle_key(FALSE, keys[i % DIMOF(keys)], NULL);
+
+	pthread_mutex_lock(&calibrate_lock);
+	deadline = sent_at + CALIBRATE_TIMEOUT;
+	while (!seen_at && now_us() < deadline)
+	    wait_until(deadline);
+
+	if (seen_at) {
+	    latency[n++] = seen_at - sent_at;
+	    debug("round %d: %lldus\n", i, (long long)(seen_at - sent_at));
+	} else {
+	    fprintf(stderr, "round %d: no change within %dms\n", i,
+		    CALIBRATE_TIMEOUT / 1000);
+	}
+    }
+    pthread_mutex_unlock(&calibrate_lock);
+
+    if (n) {
+	qsort(latency, n, sizeof(latency[0]), cmp_latency);
+	printf("latency over %d of %d rounds: min %.1fms median %.1fms"
+		" p90 %.1fms max %.1fms\n", n, CALIBRATE_ROUNDS,
+		latency[0] / 1000.0, latency[n / 2] / 1000.0,
+		latency[n * 9 / 10] / 1000.0, latency[n - 1] / 1000.0);
+    }
+
+out:
+    active = 0;
+    video_release_capture();
+    return n ? 0 : -1;
+}
+
+// vim: sw=4
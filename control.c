@@ -0,0 +1,566 @@
+/*
+ * Copyright (c) 2017 SUSE LLC
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "main.h"
+#include "control.h"
+#include "history.h"
+#include "needle.h"
+#include "threads.h"
+#include "usbhiddev.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <errno.h>
+#include <stdarg.h>
+
+#include <libavutil/common.h>
+#include <libavutil/mem.h>
+
+/* line based protocol on a unix socket. Each request is one line, the
+ * answer is either "ERR <message>" or "OK <length>" followed by <length>
+ * bytes of payload. Asynchronous notifications are sent to all clients as
+ * "EVENT ..." lines.
+ *
+ * $ printf 'thumbnail\n' | socat - UNIX-CONNECT:/run/ts2rfb.sock
+ */
+
+#define MAX_CLIENTS 16
+#define MAX_LINE 4096
+#define MAX_OUTPUT (64*1024*1024)
+
+struct client {
+    int fd;
+    char buf[MAX_LINE];
+    size_t len;
+    int holds_capture;
+    /* binary payload of a command, collected by the poll loop */
+    uint8_t* payload;
+    size_t payload_len, payload_have;
+    int (*payload_handler)(struct client* c, char* args);
+    char payload_args[MAX_LINE];
+    /* replies and events waiting for the socket, flushed by the poll loop */
+    char* out;
+    size_t out_len, out_size;
+};
+
+static int listenfd = -1;
+static char* socket_path;
+static pthread_t control_tid;
+static struct client clients[MAX_CLIENTS];
+/* events come from the capture thread, they must not end up in the middle
+ * of a reply. Client sockets are non-blocking and output is only queued
+ * under the lock, it is never held across a write that could block */
+static pthread_mutex_t write_lock = PTHREAD_MUTEX_INITIALIZER;
+/* tells the poll loop that there is output to wait for */
+static int wakefd = -1;
+
+/* called with write_lock held. A client that lets that much pile up is not
+ * reading anymore */
+static int queue_output(struct client* c, const void* buf, size_t len)
+{
+    if (c->out_len + len > MAX_OUTPUT)
+	return -1;
+    if (c->out_len + len > c->out_size) {
+	size_t size = FFMAX(c->out_size * 2, c->out_len + len);
+	char* out = realloc(c->out, size);
+	if (!out)
+	    return -1;
+	c->out = out;
+	c->out_size = size;
+    }
+    memcpy(c->out + c->out_len, buf, len);
+    c->out_len += len;
+    return 0;
+}
+
+static void wake_loop()
+{
+    uint64_t one = 1;
+    write(wakefd, &one, sizeof(one));
+}
+
+static int reply_error(struct client* c, const char* msg)
+{
+    char line[256];
+    int ret;
+
+    snprintf(line, sizeof(line), "ERR %s\n", msg);
+    pthread_mutex_lock(&write_lock);
+    ret = queue_output(c, line, strlen(line));
+    pthread_mutex_unlock(&write_lock);
+    return ret;
+}
+
+static int reply_data(struct client* c, const void* data, size_t len)
+{
+    char line[32];
+    int ret;
+
+    snprintf(line, sizeof(line), "OK %zu\n", len);
+    pthread_mutex_lock(&write_lock);
+    ret = queue_output(c, line, strlen(line));
+    if (ret == 0)
+	ret = queue_output(c, data, len);
+    pthread_mutex_unlock(&write_lock);
+    return ret;
+}
+
+/* as much as the socket takes right now */
+static int flush_output(struct client* c)
+{
+    ssize_t r;
+    int ret = 0;
+
+    pthread_mutex_lock(&write_lock);
+    r = send(c->fd, c->out, c->out_len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (r > 0) {
+	memmove(c->out, c->out + r, c->out_len - r);
+	c->out_len -= r;
+    } else if (r < 0 && errno != EAGAIN && errno != EINTR) {
+	ret = -1;
+    }
+    pthread_mutex_unlock(&write_lock);
+    return ret;
+}
+
+/* binary payload following a command line. Whatever was already buffered
+ * is used first, the rest is collected by the poll loop so a slow client
+ * doesn't hold up the others. The handler is called again with the same
+ * arguments once the payload is complete */
+static int expect_payload(struct client* c, size_t len,
+	int (*handler)(struct client* c, char* args), const char* args)
+{
+    size_t n = FFMIN(len, c->len);
+
+    c->payload = malloc(len);
+    if (!c->payload)
+	return -1;
+    memcpy(c->payload, c->buf, n);
+    memmove(c->buf, c->buf + n, c->len - n);
+    c->len -= n;
+
+    c->payload_len = len;
+    c->payload_have = n;
+    c->payload_handler = handler;
+    snprintf(c->payload_args, sizeof(c->payload_args), "%s", args);
+    return 0;
+}
+
+static void free_payload(struct client* c)
+{
+    free(c->payload);
+    c->payload = NULL;
+    c->payload_len = c->payload_have = 0;
+}
+
+void control_event(const char* fmt, ...)
+{
+    char line[512];
+    va_list ap;
+    int len, i;
+
+    strcpy(line, "EVENT ");
+    va_start(ap, fmt);
+    len = vsnprintf(line + 6, sizeof(line) - 7, fmt, ap);
+    va_end(ap);
+    len = FFMIN(len + 6, sizeof(line) - 2);
+    line[len++] = '\n';
+
+    /* never block the capture thread on a slow client, the line is only
+     * queued. One that can't take any more is disconnected, the control
+     * thread notices and drops it */
+    pthread_mutex_lock(&write_lock);
+    for (i = 0; i < MAX_CLIENTS; ++i) {
+	if (clients[i].fd != -1 && queue_output(&clients[i], line, len) < 0)
+	    shutdown(clients[i].fd, SHUT_RDWR);
+    }
+    pthread_mutex_unlock(&write_lock);
+    wake_loop();
+}
+
+/* until the client disconnects */
+static void hold_capture(struct client* c)
+{
+    if (c->holds_capture)
+	return;
+    c->holds_capture = 1;
+    video_hold_capture();
+}
+
+static int cmd_thumbnail(struct client* c, char* args)
+{
+    uint8_t* png;
+    int size;
+    int ret;
+
+    /* a dashboard polling thumbnails keeps the capture running even if no
+     * vnc client is connected */
+    hold_capture(c);
+
+    if (!video_get_thumbnail(&png, &size))
+	return reply_error(c, "no frame yet");
+
+    ret = reply_data(c, png, size);
+    av_free(png);
+    return ret;
+}
+
+/* screenshot <seconds ago> */
+static int cmd_screenshot(struct client* c, char* args)
+{
+    uint8_t* png;
+    int size;
+    int ret;
+
+    if (!history_screenshot(atof(args), &png, &size))
+	return reply_error(c, "not in history");
+
+    ret = reply_data(c, png, size);
+    av_free(png);
+    return ret;
+}
+
+static int cmd_stats(struct client* c, char* args)
+{
+    char buf[1024];
+    int len;
+
+    len = video_format_stats(buf, sizeof(buf));
+    return reply_data(c, buf, FFMIN(len, sizeof(buf) - 1));
+}
+
+/* needle_add <name> <x> <y> <w> <h> <threshold>, followed by w*h*3 bytes
+ * of RGB reference image */
+static int cmd_needle_add(struct client* c, char* args)
+{
+    char name[64];
+    int x, y, w, h;
+    double threshold;
+    int ret;
+
+    if (sscanf(args, "%63s %d %d %d %d %lf", name, &x, &y, &w, &h, &threshold) != 6)
+	return reply_error(c, "usage: needle_add name x y w h threshold");
+    if (w <= 0 || h <= 0 || x < 0 || y < 0
+	    || x + w > rfbScreen->width || y + h > rfbScreen->height)
+	return reply_error(c, "area outside of screen");
+
+    if (!c->payload)
+	return expect_payload(c, w * h * 3, cmd_needle_add, args);
+
+    ret = needle_add(name, x, y, w, h, threshold, c->payload);
+    if (ret < 0)
+	return reply_error(c, "failed to add needle");
+
+    hold_capture(c);
+    return reply_data(c, NULL, 0);
+}
+
+static int cmd_needle_del(struct client* c, char* args)
+{
+    if (needle_remove(args) < 0)
+	return reply_error(c, "no such needle");
+    return reply_data(c, NULL, 0);
+}
+
+static int cmd_threads(struct client* c, char* args)
+{
+    char buf[1024];
+    int len;
+
+    len = thread_policy_report(buf, sizeof(buf));
+    return reply_data(c, buf, len);
+}
+
+/* type <layout> <text>, text is UTF-8 with \n, \t and \\ escapes. Answers
+ * with a job id right away, "EVENT type <id> done" follows when the last
+ * report was written */
+static int cmd_type(struct client* c, char* args)
+{
+    char* text = strchr(args, ' ');
+    char id[16];
+    char* s;
+    char* d;
+    int ret;
+
+    if (!text)
+	return reply_error(c, "usage: type layout text");
+    *text++ = 0;
+
+    for (s = d = text; *s; ++s, ++d) {
+	if (*s == '\\' && s[1]) {
+	    ++s;
+	    *d = *s == 'n' ? '\n' : *s == 't' ? '\t' : *s;
+	} else
+	    *d = *s;
+    }
+    *d = 0;
+
+    ret = usbhid_type(args, text);
+    if (ret == -ENODEV)
+	return reply_error(c, "no usb hid device");
+    if (ret < 0)
+	return reply_error(c, "out of memory");
+    if (ret == 0)
+	return reply_error(c, "unknown layout or character");
+
+    snprintf(id, sizeof(id), "%d", ret);
+    return reply_data(c, id, strlen(id));
+}
+
+static struct {
+    const char* name;
+    int (*handler)(struct client* c, char* args);
+} commands[] = {
+    { "needle_add", cmd_needle_add },
+    { "needle_del", cmd_needle_del },
+    { "screenshot", cmd_screenshot },
+    { "stats", cmd_stats },
+    { "threads", cmd_threads },
+    { "thumbnail", cmd_thumbnail },
+    { "type", cmd_type },
+};
+
+static int handle_line(struct client* c, char* line)
+{
+    char* args;
+    int i;
+
+    args = strchr(line, ' ');
+    if (args)
+	*args++ = 0;
+    else
+	args = line + strlen(line);
+
+    for (i = 0; i < DIMOF(commands); ++i) {
+	if (!strcmp(commands[i].name, line))
+	    return commands[i].handler(c, args);
+    }
+
+    return reply_error(c, "unknown command");
+}
+
+static void drop_client(struct client* c)
+{
+    pthread_mutex_lock(&write_lock);
+    close(c->fd);
+    c->fd = -1;
+    c->len = 0;
+    free(c->out);
+    c->out = NULL;
+    c->out_len = c->out_size = 0;
+    pthread_mutex_unlock(&write_lock);
+    free_payload(c);
+
+    if (c->holds_capture) {
+	c->holds_capture = 0;
+	video_release_capture();
+    }
+}
+
+static void handle_input(struct client* c)
+{
+    ssize_t r;
+    char* nl;
+
+    if (c->payload)
+	r = read(c->fd, c->payload + c->payload_have,
+		c->payload_len - c->payload_have);
+    else
+	r = read(c->fd, c->buf + c->len, sizeof(c->buf) - c->len);
+    if (r < 0 && (errno == EAGAIN || errno == EINTR))
+	return;
+    if (r <= 0) {
+	drop_client(c);
+	return;
+    }
+    if (c->payload)
+	c->payload_have += r;
+    else
+	c->len += r;
+
+    for (;;) {
+	char line[MAX_LINE];
+	size_t n;
+	int ret;
+
+	if (c->payload) {
+	    if (c->payload_have < c->payload_len)
+		return;
+	    ret = c->payload_handler(c, c->payload_args);
+	    free_payload(c);
+	    if (ret < 0) {
+		drop_client(c);
+		return;
+	    }
+	    continue;
+	}
+
+	nl = memchr(c->buf, '\n', c->len);
+	if (!nl)
+	    break;
+	n = nl - c->buf + 1;
+
+	/* take the line out of the buffer first, the command may consume a
+	 * payload after it */
+	memcpy(line, c->buf, n - 1);
+	line[n - 1] = 0;
+	if (n > 1 && line[n - 2] == '\r')
+	    line[n - 2] = 0;
+	memmove(c->buf, c->buf + n, c->len - n);
+	c->len -= n;
+
+	if (handle_line(c, line) < 0) {
+	    drop_client(c);
+	    return;
+	}
+    }
+
+    if (c->len == sizeof(c->buf)) {
+	reply_error(c, "line too long");
+	drop_client(c);
+    }
+}
+
+static void* _control_loop(void* arg)
+{
+    struct pollfd pfd[MAX_CLIENTS+2];
+    uint64_t count;
+    int i;
+
+    thread_policy_apply(THREAD_CONTROL);
+
+    for (;;) {
+	pfd[0].fd = listenfd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = wakefd;
+	pfd[1].events = POLLIN;
+	pthread_mutex_lock(&write_lock);
+	for (i = 0; i < MAX_CLIENTS; ++i) {
+	    pfd[i+2].fd = clients[i].fd;
+	    pfd[i+2].events = POLLIN | (clients[i].out_len ? POLLOUT : 0);
+	}
+	pthread_mutex_unlock(&write_lock);
+
+	if (poll(pfd, MAX_CLIENTS+2, -1) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    fprintf(stderr, "control: poll failed: %m\n");
+	    break;
+	}
+
+	if (pfd[1].revents & POLLIN)
+	    read(wakefd, &count, sizeof(count));
+
+	for (i = 0; i < MAX_CLIENTS; ++i) {
+	    struct client* c = &clients[i];
+	    if (c->fd != -1 && (pfd[i+2].revents & POLLOUT) && flush_output(c) < 0)
+		drop_client(c);
+	    if (c->fd != -1 && (pfd[i+2].revents & ~POLLOUT))
+		handle_input(c);
+	}
+
+	if (pfd[0].revents & POLLIN) {
+	    int fd = accept(listenfd, NULL, NULL);
+	    if (fd < 0)
+		continue;
+	    fcntl(fd, F_SETFL, O_NONBLOCK);
+	    pthread_mutex_lock(&write_lock);
+	    for (i = 0; i < MAX_CLIENTS; ++i) {
+		if (clients[i].fd == -1) {
+		    clients[i].fd = fd;
+		    break;
+		}
+	    }
+	    pthread_mutex_unlock(&write_lock);
+	    if (i == MAX_CLIENTS) {
+		static const char msg[] = "ERR too many clients\n";
+		send(fd, msg, sizeof(msg) - 1, MSG_NOSIGNAL);
+		close(fd);
+	    }
+	}
+    }
+
+    return NULL;
+}
+
+int control_init(const char* path)
+{
+    struct sockaddr_un addr;
+    int i;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+	fprintf(stderr, "control socket path too long\n");
+	return -1;
+    }
+
+    wakefd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (wakefd < 0) {
+	fprintf(stderr, "control: %m\n");
+	return -1;
+    }
+
+    listenfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listenfd < 0) {
+	fprintf(stderr, "failed to create control socket: %m\n");
+	return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+
+    if (bind(listenfd, (struct sockaddr*)&addr, sizeof(addr)) < 0
+	    || listen(listenfd, 5) < 0) {
+	fprintf(stderr, "failed to listen on %s: %m\n", path);
+	close(listenfd);
+	listenfd = -1;
+	return -1;
+    }
+    socket_path = strdup(path);
+
+    for (i = 0; i < MAX_CLIENTS; ++i)
+	clients[i].fd = -1;
+
+    pthread_create(&control_tid, NULL, _control_loop, NULL);
+    return 0;
+}
+
+void control_close()
+{
+    if (listenfd == -1)
+	return;
+
+    pthread_cancel(control_tid);
+    pthread_join(control_tid, NULL);
+    close(listenfd);
+    listenfd = -1;
+    unlink(socket_path);
+    free(socket_path);
+}
+
+// vim: sw=4
@@ -22,8 +22,13 @@
 #ifndef _DEBUG_H_
 #define _DEBUG_H_
 
-#define debug(fmt, args...) \
-  _debug(__FILE__, __LINE__, __FUNCTION__, fmt, ##args)
+/* off unless -v is given, the arguments are not even evaluated then */
+#define debug(fmt, args...) do { \
+  if (debug_enabled) \
+    _debug(__FILE__, __LINE__, __FUNCTION__, fmt, ##args); \
+} while (0)
+
+extern int debug_enabled;
 
 void _debug(const char* file, int line, const char* function, const char* fmt, ...);
 
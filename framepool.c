@@ -0,0 +1,144 @@
+/*
+ * Copyright (c) 2017 SUSE LLC
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "framepool.h"
+
+#include <sys/mman.h>
+#include <pthread.h>
+#include <stdio.h>
+
+/* fixed set of frame sized buffers so the capture loop doesn't have to go
+ * through malloc for every frame. Buffers come from huge pages if the system
+ * has some reserved, transparent huge pages otherwise. mmap returns page
+ * aligned memory so every buffer starts on a cache line as well. */
+
+#define HUGEPAGE_SIZE (2*1024*1024)
+#define CACHELINE_SIZE 64
+#define MAX_BUFFERS 16
+
+#define ALIGN(x, a) (((x)+(a)-1)&~((size_t)(a)-1))
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint8_t* pool_mem;
+static size_t pool_len;
+static size_t buf_size;
+static int num_buffers;
+static uint8_t* free_list[MAX_BUFFERS];
+static int num_free;
+
+void* framepool_alloc(size_t size)
+{
+    size_t len = ALIGN(size, HUGEPAGE_SIZE);
+    void* p;
+
+    p = mmap(NULL, len, PROT_READ|PROT_WRITE,
+	    MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+    if (p == MAP_FAILED) {
+	p = mmap(NULL, len, PROT_READ|PROT_WRITE,
+		MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+	    return NULL;
+	madvise(p, len, MADV_HUGEPAGE);
+    }
+
+    return p;
+}
+
+void framepool_release(void* ptr, size_t size)
+{
+    if (ptr)
+	munmap(ptr, ALIGN(size, HUGEPAGE_SIZE));
+}
+
+int framepool_init(size_t size, int count)
+{
+    int i;
+
+    if (count > MAX_BUFFERS)
+	count = MAX_BUFFERS;
+    size = ALIGN(size, CACHELINE_SIZE);
+
+    pthread_mutex_lock(&pool_lock);
+    if (pool_mem && size == buf_size && count == num_buffers) {
+	pthread_mutex_unlock(&pool_lock);
+	return 0;
+    }
+
+    if (pool_mem && num_free != num_buffers) {
+	pthread_mutex_unlock(&pool_lock);
+	fprintf(stderr, "framepool: can't resize while buffers are in use\n");
+	return -1;
+    }
+
+    framepool_release(pool_mem, pool_len);
+    pool_len = size * count;
+    pool_mem = framepool_alloc(pool_len);
+    if (!pool_mem) {
+	pthread_mutex_unlock(&pool_lock);
+	fprintf(stderr, "framepool: failed to allocate %zu bytes: %m\n", pool_len);
+	buf_size = num_buffers = num_free = 0;
+	return -1;
+    }
+
+    buf_size = size;
+    num_buffers = count;
+    for (i = 0; i < count; ++i)
+	free_list[i] = pool_mem + i * size;
+    num_free = count;
+    pthread_mutex_unlock(&pool_lock);
+
+    return 0;
+}
+
+uint8_t* framepool_get()
+{
+    uint8_t* buf = NULL;
+
+    pthread_mutex_lock(&pool_lock);
+    if (num_free)
+	buf = free_list[--num_free];
+    pthread_mutex_unlock(&pool_lock);
+
+    return buf;
+}
+
+void framepool_put(uint8_t* buf)
+{
+    if (!buf)
+	return;
+
+    pthread_mutex_lock(&pool_lock);
+    free_list[num_free++] = buf;
+    pthread_mutex_unlock(&pool_lock);
+}
+
+void framepool_cleanup()
+{
+    pthread_mutex_lock(&pool_lock);
+    framepool_release(pool_mem, pool_len);
+    pool_mem = NULL;
+    pool_len = buf_size = 0;
+    num_buffers = num_free = 0;
+    pthread_mutex_unlock(&pool_lock);
+}
+
+// vim: sw=4
@@ -0,0 +1,203 @@
+/*
+ * Copyright (c) 2017 SUSE LLC
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "main.h"
+#include "history.h"
+
+#include <libavutil/imgutils.h>
+#include <libavutil/time.h>
+#include <libswscale/swscale.h>
+
+#include <pthread.h>
+
+/* the last few seconds of compressed video, so a screenshot from the past
+ * can be produced after a test failed. Packets are only referenced, not
+ * copied, and decoding only happens when someone asks: starting at the
+ * closest key frame before the requested time, with a separate decoder.
+ * Packets are indexed by arrival time since the stream timestamps restart
+ * when the extender does. */
+
+#define HISTORY_MAX_PACKETS 8192
+#define HISTORY_MAX_BYTES (64*1024*1024)
+
+struct entry {
+    AVPacket pkt;
+    int64_t time;
+};
+
+static int64_t history_length;
+static struct entry ring[HISTORY_MAX_PACKETS];
+static int head, count;
+static size_t bytes;
+static AVCodecParameters* codecpar;
+static pthread_mutex_t history_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define AT(i) (&ring[(head + (i)) % HISTORY_MAX_PACKETS])
+
+void history_set_length(int seconds)
+{
+    history_length = seconds * 1000000LL;
+}
+
+static void drop_oldest()
+{
+    struct entry* e = AT(0);
+
+    bytes -= e->pkt.size;
+    av_packet_unref(&e->pkt);
+    head = (head + 1) % HISTORY_MAX_PACKETS;
+    --count;
+}
+
+void history_reset(const AVCodecParameters* par)
+{
+    if (!history_length)
+	return;
+
+    pthread_mutex_lock(&history_lock);
+    while (count)
+	drop_oldest();
+    if (!codecpar)
+	codecpar = avcodec_parameters_alloc();
+    if (codecpar)
+	avcodec_parameters_copy(codecpar, par);
+    pthread_mutex_unlock(&history_lock);
+}
+
+void history_add(const AVPacket* pkt)
+{
+    int64_t now = av_gettime_relative();
+    struct entry* e;
+
+    if (!history_length)
+	return;
+
+    pthread_mutex_lock(&history_lock);
+    while (count && (count == HISTORY_MAX_PACKETS
+		|| bytes + pkt->size > HISTORY_MAX_BYTES
+		|| now - AT(0)->time > history_length))
+	drop_oldest();
+
+    e = AT(count);
+    if (av_packet_ref(&e->pkt, pkt) == 0) {
+	e->time = now;
+	bytes += pkt->size;
+	++count;
+    }
+    pthread_mutex_unlock(&history_lock);
+}
+
+static int decode_range(AVPacket* pkts, int n, AVFrame* out)
+{
+    AVCodecContext* ctx;
+    AVCodec* dec;
+    AVFrame* f;
+    int i, got = 0;
+
+    dec = avcodec_find_decoder(codecpar->codec_id);
+    if (!dec)
+	return 0;
+    ctx = avcodec_alloc_context3(dec);
+    f = av_frame_alloc();
+    if (!ctx || !f || avcodec_parameters_to_context(ctx, codecpar) < 0
+	    || avcodec_open2(ctx, dec, NULL) < 0)
+	goto end;
+
+    for (i = 0; i <= n; ++i) {
+	/* NULL flushes the decoder after the last packet */
+	if (avcodec_send_packet(ctx, i < n ? &pkts[i] : NULL) < 0)
+	    continue;
+	while (avcodec_receive_frame(ctx, f) == 0) {
+	    av_frame_unref(out);
+	    av_frame_move_ref(out, f);
+	    got = 1;
+	}
+    }
+
+end:
+    av_frame_free(&f);
+    avcodec_free_context(&ctx);
+    return got;
+}
+
+int history_screenshot(double seconds_ago, uint8_t** png, int* size)
+{
+    int64_t target = av_gettime_relative() - seconds_ago * 1000000;
+    struct SwsContext* sws = NULL;
+    uint8_t* rgb[4] = { NULL };
+    int rgb_linesize[4];
+    AVPacket* pkts = NULL;
+    AVFrame* frame = NULL;
+    int first, last, n = 0, i;
+    int ret = 0;
+
+    pthread_mutex_lock(&history_lock);
+    if (!count || !codecpar || AT(0)->time > target) {
+	pthread_mutex_unlock(&history_lock);
+	return 0;
+    }
+    for (last = count - 1; last > 0 && AT(last)->time > target; --last)
+	;
+    for (first = last; first >= 0 && !(AT(first)->pkt.flags & AV_PKT_FLAG_KEY); --first)
+	;
+    if (first >= 0) {
+	pkts = av_malloc((last - first + 1) * sizeof(AVPacket));
+	for (i = first; pkts && i <= last; ++i) {
+	    av_init_packet(&pkts[n]);
+	    if (av_packet_ref(&pkts[n], &AT(i)->pkt) == 0)
+		++n;
+	}
+    }
+    pthread_mutex_unlock(&history_lock);
+
+    if (!n)
+	goto end;
+
+    frame = av_frame_alloc();
+    if (!frame || !decode_range(pkts, n, frame))
+	goto end;
+
+    if (av_image_alloc(rgb, rgb_linesize, rfbScreen->width, rfbScreen->height,
+		AV_PIX_FMT_RGB24, 1) < 0)
+	goto end;
+    sws = sws_getContext(frame->width, frame->height, frame->format,
+	    rfbScreen->width, rfbScreen->height, AV_PIX_FMT_RGB24,
+	    SWS_BILINEAR, NULL, NULL, NULL);
+    if (!sws)
+	goto end;
+    sws_scale(sws, (const uint8_t * const*)frame->data, frame->linesize,
+	    0, frame->height, rgb, rgb_linesize);
+
+    ret = video_encode_png(rgb[0], rgb_linesize[0],
+	    rfbScreen->width, rfbScreen->height, png, size);
+
+end:
+    sws_freeContext(sws);
+    av_freep(&rgb[0]);
+    av_frame_free(&frame);
+    for (i = 0; i < n; ++i)
+	av_packet_unref(&pkts[i]);
+    av_free(pkts);
+    return ret;
+}
+
+// vim: sw=4
@@ -21,21 +21,33 @@
  */
 
 #include "main.h"
+#include "calibrate.h"
+#include "control.h"
+#include "history.h"
+#include "probes.h"
+#include "relay.h"
 #include "serial.h"
+#include "threads.h"
 #include "usbhiddev.h"
 
+#include <getopt.h>
+
 rfbScreenInfoPtr rfbScreen;
 
+int debug_enabled;
+
 static int num_clients_connected = -1;
 
 static int serialfd = -1;
 
 static void clientgone(rfbClientPtr cl)
 {
-    video_stop_capture();
+    int users = video_release_capture();
+
     --num_clients_connected;
     debug("%d clients connected\n", num_clients_connected);
-    if (!num_clients_connected)
+    /* control clients and relay subscribers keep us running */
+    if (!num_clients_connected && !users)
 	rfbShutdownServer(rfbScreen, TRUE);
 }
 
@@ -45,15 +57,52 @@ static enum rfbNewClientAction newclient(rfbClientPtr cl)
 	++num_clients_connected;
     ++num_clients_connected;
     debug("%d clients connected\n", num_clients_connected);
-    video_start_capture();
+    video_hold_capture();
     cl->clientGoneHook = clientgone;
     return RFB_CLIENT_ACCEPT;
 }
 
+static void update_sent(rfbClientPtr cl, int result)
+{
+    PROBE2(update_sent, cl->sock, result);
+}
+
+static int same_format(const rfbPixelFormat* a, const rfbPixelFormat* b)
+{
+    return a->bitsPerPixel == b->bitsPerPixel && a->depth == b->depth
+	&& a->bigEndian == b->bigEndian && a->trueColour == b->trueColour
+	&& a->redMax == b->redMax && a->greenMax == b->greenMax
+	&& a->blueMax == b->blueMax && a->redShift == b->redShift
+	&& a->greenShift == b->greenShift && a->blueShift == b->blueShift;
+}
+
+/* called when a client sets its pixel format. If all clients agree on one
+ * the framebuffer is switched to it once the capture delivers a frame in
+ * that format, libvncserver's translation is a plain copy then */
+static rfbBool set_translate_function(rfbClientPtr cl)
+{
+    rfbClientIteratorPtr it;
+    rfbClientPtr c;
+    int uniform = 1;
+
+    it = rfbGetClientIterator(rfbScreen);
+    while ((c = rfbClientIteratorNext(it)))
+	if (c != cl && !same_format(&c->format, &cl->format))
+	    uniform = 0;
+    rfbReleaseClientIterator(it);
+
+    if (uniform && !same_format(&cl->format, &rfbScreen->serverFormat)
+	    && video_set_fb_format(&cl->format))
+	debug("switching framebuffer to the client pixel format\n");
+
+    return rfbSetTranslateFunction(cl);
+}
+
 static void HandleKey(rfbBool down, rfbKeySym key, rfbClientPtr cl)
 {
     rfbKeyEventMsg msg = { sz_rfbKeyEventMsg, down, 0, key };
 
+    PROBE2(key_event, down, key);
     usbhid_handle_key(down, key, cl);
 
     if (serialfd != -1) {
@@ -62,6 +111,50 @@ static void HandleKey(rfbBool down, rfbKeySym key, rfbClientPtr cl)
     }
 }
 
+/* rfbGetScreen only knows about true color formats with equal channel
+ * sizes so fix up the server format for the low depth modes. 16 bit is plain
+ * RGB565, 8 bit is grayscale via a colormap. RFB has no 24 bits per pixel */
+static int setup_pixel_format(rfbScreenInfoPtr screen, unsigned depth)
+{
+    rfbPixelFormat* format = &screen->serverFormat;
+    int i;
+
+    switch (depth) {
+	case 32:
+	    return 1;
+	case 16:
+	    format->redMax = 31;
+	    format->greenMax = 63;
+	    format->blueMax = 31;
+	    format->redShift = 11;
+	    format->greenShift = 5;
+	    format->blueShift = 0;
+	    break;
+	case 8:
+	    format->trueColour = FALSE;
+	    screen->colourMap.count = 256;
+	    screen->colourMap.is16 = FALSE;
+	    screen->colourMap.data.bytes = malloc(256*3);
+	    for (i = 0; i < 256; ++i)
+		memset(screen->colourMap.data.bytes + i*3, i, 3);
+	    break;
+	default:
+	    fprintf(stderr, "unsupported depth %u, use 32, 16 or 8\n", depth);
+	    return 0;
+    }
+
+    screen->bitsPerPixel = format->bitsPerPixel = depth;
+    screen->depth = format->depth = depth;
+    screen->paddedWidthInBytes = screen->width * (depth>>3);
+
+    return 1;
+}
+
+static const struct option long_options[] = {
+    { "calibrate", optional_argument, NULL, 'C' },
+    { NULL }
+};
+
 int main (int argc, char *argv[])
 {
     unsigned width = 1024;
@@ -69,8 +162,12 @@ int main (int argc, char *argv[])
     unsigned depth = 32;
     char* serialport = NULL;
     char* usbhiddev = NULL;
+    char* controlsocket = NULL;
+    char* relaysocket = NULL;
+    char* calibrate_region = NULL;
     char* port;
-    int opt;
+    int calibrate = 0;
+    int opt, ret = 0;
 
     rfbScreen = rfbGetScreen(&argc,argv, width, height, 8, /* actually unused */ 3, depth>>3);
     if(!rfbScreen) {
@@ -81,34 +178,83 @@ int main (int argc, char *argv[])
     rfbScreen->alwaysShared = TRUE;
     rfbScreen->kbdAddEvent = HandleKey;
     rfbScreen->newClientHook = newclient;
+    rfbScreen->setTranslateFunction = set_translate_function;
+    rfbScreen->displayFinishedHook = update_sent;
 
-    rfbScreen->frameBuffer = (char*)malloc(width*height*(depth>>3));
-    memset(rfbScreen->frameBuffer, 0x7F, width*height*(depth>>3));
-
-    // for openQA
-    if ((port = getenv("VNC"))) {
-        int i = atoi(port);
-        rfbScreen->port = 5900 + i;
-        rfbScreen->ipv6port = 5900 + i;
-    }
-
-    rfbInitServer(rfbScreen);
-
-    while ((opt = getopt(argc, argv, "s:u:")) != -1) {
+    while ((opt = getopt_long(argc, argv, "ac:d:H:j:n:P:r:s:t:u:v",
+		    long_options, NULL)) != -1) {
 	switch(opt) {
+	    case 'C':
+		calibrate = 1;
+		calibrate_region = optarg;
+		break;
+	    case 'a':
+		video_set_autocrop(1);
+		break;
+	    case 'c':
+		controlsocket = strdup(optarg);
+		break;
+	    case 'd':
+		depth = atoi(optarg);
+		break;
+	    case 'H':
+		history_set_length(atoi(optarg));
+		break;
+	    case 'j':
+		video_set_jitter_latency(atoi(optarg));
+		break;
+	    case 'n': {
+		char* frames = strchr(optarg, ':');
+		video_set_noise_filter(atoi(optarg), frames ? atoi(frames + 1) : 0);
+		break;
+	    }
+	    case 'P':
+		if (thread_policy_parse(optarg) < 0)
+		    exit(EXIT_FAILURE);
+		break;
+	    case 'r':
+		relaysocket = strdup(optarg);
+		break;
 	    case 's':
 		serialport = strdup(optarg);
 		break;
+	    case 't':
+		video_set_stall_timeout(atoi(optarg));
+		break;
 	    case 'u':
 		usbhiddev = strdup(optarg);
 		break;
+	    case 'v':
+		debug_enabled = 1;
+		break;
 	    default:
-	       fprintf(stderr, "Usage: %s [-s serialport] [-u usbhiddevice] videourl\n", argv[0]);
+	       fprintf(stderr, "Usage: %s [-a] [-c controlsocket] [-d depth] [-H historyseconds] [-j latency_ms] [-n threshold[:frames]] [-P role:cpus[:fifo=prio|:nice=n]] [-r relaysocket] [-s serialport] [-t stalltimeout_ms] [-u usbhiddevice] [-v] [--calibrate[=x,y,w,h]] videourl\n", argv[0]);
 	       exit(EXIT_FAILURE);
 
 	}
     }
 
+    if (!setup_pixel_format(rfbScreen, depth))
+	exit(EXIT_FAILURE);
+
+    /* threads started later set up their own policy instead of inheriting */
+    thread_policy_apply(THREAD_RFB);
+
+    rfbScreen->frameBuffer = (char*)malloc(width*height*(depth>>3));
+    memset(rfbScreen->frameBuffer, 0x7F, width*height*(depth>>3));
+
+    // for openQA
+    if ((port = getenv("VNC"))) {
+        int i = atoi(port);
+        rfbScreen->port = 5900 + i;
+        rfbScreen->ipv6port = 5900 + i;
+    }
+
+    /* calibration doesn't serve vnc clients, they would start and stop
+     * the capture */
+    if (!calibrate)
+	rfbInitServer(rfbScreen);
+
     if (serialport) {
 	serialfd = open_serial(serialport);
     }
@@ -123,7 +269,32 @@ int main (int argc, char *argv[])
 	fputs("missing video url, will run without output\n", stderr);
     }
 
-    rfbRunEventLoop(rfbScreen, 40000, FALSE);
+    if (controlsocket && control_init(controlsocket) < 0)
+	exit(EXIT_FAILURE);
+
+    if (relaysocket && relay_init(relaysocket) < 0)
+	exit(EXIT_FAILURE);
+
+    if (calibrate) {
+	if (!usbhiddev || argc - optind <= 0) {
+	    fputs("--calibrate needs -u and a video url\n", stderr);
+	    exit(EXIT_FAILURE);
+	}
+	if (calibrate_set_region(calibrate_region) < 0)
+	    exit(EXIT_FAILURE);
+	ret = calibrate_run() < 0 ? EXIT_FAILURE : 0;
+    } else {
+	/* rfbRunEventLoop plus format switches between the updates */
+	while (rfbIsActive(rfbScreen)) {
+	    rfbProcessEvents(rfbScreen, 40000);
+	    video_switch_fb_format();
+	}
+    }
+
+    control_close();
+    relay_close();
+    /* before the framebuffer goes away */
+    video_close();
 
     free(rfbScreen->frameBuffer);
 
@@ -133,7 +304,7 @@ int main (int argc, char *argv[])
 	usbhid_close();
     }
 
-    return 0;
+    return ret;
 }
 
 void _debug(const char* file, int line, const char* function, const char* fmt, ...)
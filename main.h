@@ -30,11 +30,25 @@
 
 #define DIMOF(x) (sizeof(x)/sizeof(x[0]))
 
+/* granularity of change detection on the framebuffer */
+#define TILE_SIZE 32
+
 extern rfbScreenInfoPtr rfbScreen;
 
 int video_init (int width, int height, int depth, const char* url);
-int video_start_capture();
-int video_stop_capture();
+void video_hold_capture();
+int video_release_capture();
 void video_free();
+void video_close();
+int video_get_thumbnail(uint8_t **png, int *size);
+int video_encode_png(uint8_t *data, int linesize, int w, int h,
+	uint8_t **png, int *size);
+int video_set_fb_format(const rfbPixelFormat *format);
+void video_switch_fb_format();
+void video_set_autocrop(int enable);
+void video_set_noise_filter(int threshold, int frames);
+void video_set_stall_timeout(int ms);
+void video_set_jitter_latency(int ms);
+int video_format_stats(char *buf, size_t len);
 
 #endif
@@ -0,0 +1,179 @@
+/*
+ * Copyright (c) 2017 SUSE LLC
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "main.h"
+#include "control.h"
+#include "needle.h"
+#include "sad.h"
+
+#include <libavutil/pixdesc.h>
+#include <libswscale/swscale.h>
+
+#include <pthread.h>
+
+/* server side template matching for openQA. A client registers a reference
+ * image for an area of the screen, the area is compared whenever one of the
+ * tiles it covers changed and the client gets an event when the area starts
+ * or stops matching. The area is converted back to RGB24 for that, the score
+ * is the mean absolute difference per colour channel, so 0 is a perfect match
+ * and the threshold means the same whatever format the framebuffer has. */
+
+struct needle {
+    char name[64];
+    int x, y, w, h;
+    double threshold;
+    uint8_t* rgb;
+    uint8_t* cur;
+    struct SwsContext* sws;
+    enum AVPixelFormat sws_fmt;
+    int matched;
+    struct needle* next;
+};
+
+static struct needle* needles;
+static pthread_mutex_t needle_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void needle_free(struct needle* n)
+{
+    sws_freeContext(n->sws);
+    free(n->cur);
+    free(n->rgb);
+    free(n);
+}
+
+int needle_add(const char* name, int x, int y, int w, int h, double threshold,
+	const uint8_t* rgb)
+{
+    struct needle* n;
+
+    if (w <= 0 || h <= 0 || x < 0 || y < 0
+	    || x + w > rfbScreen->width || y + h > rfbScreen->height)
+	return -1;
+
+    n = calloc(1, sizeof(*n));
+    if (!n)
+	return -1;
+    n->rgb = malloc(w * h * 3);
+    n->cur = malloc(w * h * 3);
+    if (!n->rgb || !n->cur) {
+	needle_free(n);
+	return -1;
+    }
+
+    snprintf(n->name, sizeof(n->name), "%s", name);
+    n->x = x;
+    n->y = y;
+    n->w = w;
+    n->h = h;
+    n->threshold = threshold;
+    memcpy(n->rgb, rgb, w * h * 3);
+    n->sws_fmt = AV_PIX_FMT_NONE;
+    n->matched = -1;
+
+    needle_remove(name);
+
+    pthread_mutex_lock(&needle_lock);
+    n->next = needles;
+    needles = n;
+    pthread_mutex_unlock(&needle_lock);
+
+    return 0;
+}
+
+int needle_remove(const char* name)
+{
+    struct needle** p;
+    int ret = -1;
+
+    pthread_mutex_lock(&needle_lock);
+    for (p = &needles; *p; p = &(*p)->next) {
+	if (!strcmp((*p)->name, name)) {
+	    struct needle* n = *p;
+	    *p = n->next;
+	    needle_free(n);
+	    ret = 0;
+	    break;
+	}
+    }
+    pthread_mutex_unlock(&needle_lock);
+
+    return ret;
+}
+
+/* the scaler only changes with the framebuffer format */
+static int setup_scaler(struct needle* n, enum AVPixelFormat fmt)
+{
+    sws_freeContext(n->sws);
+    n->sws = sws_getContext(n->w, n->h, fmt, n->w, n->h, AV_PIX_FMT_RGB24,
+	    SWS_POINT, NULL, NULL, NULL);
+    n->sws_fmt = n->sws ? fmt : AV_PIX_FMT_NONE;
+    return n->sws ? 0 : -1;
+}
+
+static int needle_dirty(struct needle* n, const uint8_t* dirty, int tiles_x)
+{
+    int tx, ty;
+
+    for (ty = n->y / TILE_SIZE; ty <= (n->y + n->h - 1) / TILE_SIZE; ++ty)
+	for (tx = n->x / TILE_SIZE; tx <= (n->x + n->w - 1) / TILE_SIZE; ++tx)
+	    if (dirty[ty * tiles_x + tx])
+		return 1;
+    return 0;
+}
+
+void needle_check(const uint8_t* fb, int linesize, enum AVPixelFormat fmt,
+	const uint8_t* dirty, int tiles_x)
+{
+    int bpp = av_get_bits_per_pixel(av_pix_fmt_desc_get(fmt)) >> 3;
+    struct needle* n;
+
+    pthread_mutex_lock(&needle_lock);
+    for (n = needles; n; n = n->next) {
+	const uint8_t* src[4] = { fb + n->y * linesize + n->x * bpp };
+	int src_linesize[4] = { linesize };
+	uint8_t* dst[4] = { n->cur };
+	int dst_linesize[4] = { n->w * 3 };
+	double score;
+	int matched;
+
+	if (n->sws_fmt != fmt) {
+	    if (setup_scaler(n, fmt) < 0)
+		continue;
+	    n->matched = -1;
+	}
+
+	if (n->matched != -1 && !needle_dirty(n, dirty, tiles_x))
+	    continue;
+
+	sws_scale(n->sws, src, src_linesize, 0, n->h, dst, dst_linesize);
+	score = (double)sad_u8(n->cur, n->rgb, n->w * n->h * 3) / (n->w * n->h * 3);
+	matched = score <= n->threshold;
+	if (matched != n->matched) {
+	    n->matched = matched;
+	    control_event("needle %s %s %.2f", n->name,
+		    matched ? "match" : "nomatch", score);
+	}
+    }
+    pthread_mutex_unlock(&needle_lock);
+}
+
+// vim: sw=4
@@ -0,0 +1,432 @@
+/*
+ * Copyright (c) 2017 SUSE LLC
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+#include "main.h"
+#include "relay.h"
+#include "threads.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* re-publish the received transport stream to local tools so they don't all
+ * have to join the multicast group. A subscriber connects to the unix
+ * socket and receives the read end of a pipe via SCM_RIGHTS, the socket is
+ * closed after that. Each chunk is written once into a master pipe and
+ * tee()d into the subscriber pipes, which only takes page references.
+ * vmsplice of the ffmpeg buffer would save the one copy, but the pages
+ * would still be referenced by the subscriber pipes when ffmpeg reuses the
+ * buffer.
+ *
+ * New subscribers start at the next key frame, prefixed with the last
+ * PAT and PMT so they can decode right away. Subscribers that can't keep
+ * up are dropped. */
+
+#define TS_PACKET_SIZE 188
+#define MAX_SUBSCRIBERS 16
+#define SUBSCRIBER_PIPE_SIZE (1024*1024)
+
+struct subscriber {
+    int fd;
+    int active;
+};
+
+static int listenfd = -1;
+static char* socket_path;
+static pthread_t relay_tid;
+static pthread_mutex_t relay_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct subscriber subscribers[MAX_SUBSCRIBERS];
+static int num_subscribers;
+static int master[2] = { -1, -1 };
+static int devnull = -1;
+
+static uint8_t pat[TS_PACKET_SIZE];
+static uint8_t pmt[TS_PACKET_SIZE];
+static int have_pat, have_pmt;
+static int pmt_pid = -1;
+
+/* chunks from stream or file input don't end on packet boundaries. The
+ * start of a packet that didn't fit into the last chunk is kept */
+static uint8_t carry[TS_PACKET_SIZE];
+static int carry_len;
+
+static int send_fd(int sock, int fd)
+{
+    char dummy = 0;
+    struct iovec iov = { &dummy, 1 };
+    char cbuf[CMSG_SPACE(sizeof(int))];
+    struct msghdr msg = { 0 };
+    struct cmsghdr* cmsg;
+
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    return sendmsg(sock, &msg, MSG_NOSIGNAL) < 0 ? -1 : 0;
+}
+
+static void add_subscriber(int sock)
+{
+    int p[2];
+    int i;
+
+    if (pipe2(p, O_CLOEXEC) < 0) {
+	fprintf(stderr, "relay: failed to create pipe: %m\n");
+	return;
+    }
+    fcntl(p[1], F_SETPIPE_SZ, SUBSCRIBER_PIPE_SIZE);
+    fcntl(p[1], F_SETFL, O_NONBLOCK);
+
+    if (send_fd(sock, p[0]) < 0) {
+	close(p[0]);
+	close(p[1]);
+	return;
+    }
+    close(p[0]);
+
+    pthread_mutex_lock(&relay_lock);
+    for (i = 0; i < MAX_SUBSCRIBERS; ++i) {
+	if (subscribers[i].fd == -1) {
+	    subscribers[i].fd = p[1];
+	    subscribers[i].active = 0;
+	    ++num_subscribers;
+	    break;
+	}
+    }
+    pthread_mutex_unlock(&relay_lock);
+
+    if (i == MAX_SUBSCRIBERS) {
+	fputs("relay: too many subscribers\n", stderr);
+	close(p[1]);
+	return;
+    }
+
+    /* subscribers want the stream even without a vnc client */
+    video_hold_capture();
+}
+
+static void drop_subscriber(struct subscriber* s)
+{
+    close(s->fd);
+    s->fd = -1;
+    --num_subscribers;
+    video_release_capture();
+}
+
+static void* _relay_accept(void* arg)
+{
+    thread_policy_default();
+
+    for (;;) {
+	int fd = accept(listenfd, NULL, NULL);
+	if (fd < 0)
+	    continue;
+	add_subscriber(fd);
+	close(fd);
+    }
+    return NULL;
+}
+
+static int payload_offset(const uint8_t* p)
+{
+    int afc = (p[3] >> 4) & 3;
+
+    if (!(afc & 1))
+	return -1;
+    if (afc & 2)
+	return 5 + p[4] < TS_PACKET_SIZE ? 5 + p[4] : -1;
+    return 4;
+}
+
+/* remember the tables a new subscriber needs first. Only single packet
+ * sections, that's what the extenders send */
+static void track_psi(const uint8_t* p, int pid)
+{
+    int off, i;
+
+    if (!(p[1] & 0x40))
+	return;
+
+    if (pid == 0) {
+	memcpy(pat, p, TS_PACKET_SIZE);
+	have_pat = 1;
+	off = payload_offset(p);
+	if (off < 0)
+	    return;
+	off += 1 + p[off];
+	/* skip table header, walk the program loop for the first pmt */
+	for (i = off + 8; i + 4 <= TS_PACKET_SIZE - 4; i += 4) {
+	    if ((p[i] << 8 | p[i+1]) != 0) {
+		pmt_pid = (p[i+2] & 0x1f) << 8 | p[i+3];
+		break;
+	    }
+	}
+    } else if (pid == pmt_pid) {
+	memcpy(pmt, p, TS_PACKET_SIZE);
+	have_pmt = 1;
+    }
+}
+
+/* packet of the video stream that starts a key frame: either flagged as
+ * random access point or starting with SPS or IDR */
+static int is_keyframe(const uint8_t* p, int video_pid)
+{
+    int pid = (p[1] & 0x1f) << 8 | p[2];
+    int payload, i;
+
+    if (!(p[1] & 0x40) || (video_pid >= 0 && pid != video_pid) || pid < 0x20)
+	return 0;
+    if ((p[3] & 0x20) && p[4] && (p[5] & 0x40))
+	return 1;
+
+    payload = payload_offset(p);
+    if (payload < 0)
+	return 0;
+    for (i = payload; i + 3 < TS_PACKET_SIZE; ++i) {
+	if (p[i] == 0 && p[i+1] == 0 && p[i+2] == 1
+		&& ((p[i+3] & 0x1f) == 7 || (p[i+3] & 0x1f) == 5))
+	    return 1;
+    }
+    return 0;
+}
+
+/* next packet start, confirmed by the following sync byte if there is one */
+static int resync(const uint8_t* buf, int len, int off)
+{
+    for (; off < len; ++off)
+	if (buf[off] == 0x47 && (off + TS_PACKET_SIZE >= len
+		    || buf[off + TS_PACKET_SIZE] == 0x47))
+	    break;
+    return off;
+}
+
+static void scan_packet(const uint8_t* p, int video_pid, int off, int* key)
+{
+    track_psi(p, (p[1] & 0x1f) << 8 | p[2]);
+    if (*key == INT_MIN && is_keyframe(p, video_pid))
+	*key = off;
+}
+
+/* offset of the first packet in the chunk that starts a key frame, negative
+ * if it began in the previous chunk, INT_MIN if there is none. Tracks PAT
+ * and PMT on the way */
+static int find_keyframe(const uint8_t* buf, int len, int video_pid)
+{
+    uint8_t p[TS_PACKET_SIZE];
+    int key = INT_MIN;
+    int off = 0;
+
+    if (carry_len) {
+	int need = TS_PACKET_SIZE - carry_len;
+	if (len < need) {
+	    memcpy(carry + carry_len, buf, len);
+	    carry_len += len;
+	    return key;
+	}
+	memcpy(p, carry, carry_len);
+	memcpy(p + carry_len, buf, need);
+	scan_packet(p, video_pid, -carry_len, &key);
+	off = need;
+    }
+
+    for (off = resync(buf, len, off); off + TS_PACKET_SIZE <= len;
+	    off = resync(buf, len, off + TS_PACKET_SIZE))
+	scan_packet(buf + off, video_pid, off, &key);
+
+    carry_len = len - off;
+    memcpy(carry, buf + off, carry_len);
+    return key;
+}
+
+/* head is the part of the first packet that came with the previous chunk */
+static int start_subscriber(struct subscriber* s, const uint8_t* head,
+	int head_len, const uint8_t* buf, int len)
+{
+    if (have_pat && write(s->fd, pat, TS_PACKET_SIZE) != TS_PACKET_SIZE)
+	return -1;
+    if (have_pmt && write(s->fd, pmt, TS_PACKET_SIZE) != TS_PACKET_SIZE)
+	return -1;
+    if (head_len && write(s->fd, head, head_len) != head_len)
+	return -1;
+    if (write(s->fd, buf, len) != len)
+	return -1;
+    s->active = 1;
+    return 0;
+}
+
+void relay_feed(const uint8_t* buf, int len, int video_pid)
+{
+    uint8_t head[TS_PACKET_SIZE];
+    int key, head_len, active = 0;
+    int i;
+
+    if (listenfd == -1 || !num_subscribers) {
+	/* would be stale by the time someone subscribes */
+	carry_len = 0;
+	return;
+    }
+
+    pthread_mutex_lock(&relay_lock);
+    head_len = carry_len;
+    memcpy(head, carry, carry_len);
+    key = find_keyframe(buf, len, video_pid);
+    /* the key frame packet began with the previous chunk */
+    if (key != INT_MIN && key < 0)
+	key = 0;
+    else
+	head_len = 0;
+
+    for (i = 0; i < MAX_SUBSCRIBERS; ++i) {
+	struct subscriber* s = &subscribers[i];
+	if (s->fd == -1)
+	    continue;
+	if (s->active)
+	    ++active;
+	else if (key != INT_MIN && start_subscriber(s, head, head_len,
+		    buf + key, len - key) < 0)
+	    drop_subscriber(s);
+	/* started with this chunk already, tee from the next one on */
+	else if (key != INT_MIN)
+	    s->active = -1;
+    }
+
+    if (active && write(master[1], buf, len) == len) {
+	for (i = 0; i < MAX_SUBSCRIBERS; ++i) {
+	    struct subscriber* s = &subscribers[i];
+	    if (s->fd == -1 || s->active != 1)
+		continue;
+	    if (tee(master[0], s->fd, len, SPLICE_F_NONBLOCK) != len) {
+		fprintf(stderr, "relay: subscriber too slow, dropping\n");
+		drop_subscriber(s);
+	    }
+	}
+	if (splice(master[0], NULL, devnull, NULL, len, 0) != len) {
+	    uint8_t scratch[4096];
+	    while (read(master[0], scratch, sizeof(scratch)) > 0)
+		;
+	}
+    }
+
+    for (i = 0; i < MAX_SUBSCRIBERS; ++i)
+	if (subscribers[i].active == -1)
+	    subscribers[i].active = 1;
+    pthread_mutex_unlock(&relay_lock);
+}
+
+/* the input was reopened, make everyone wait for the next key frame */
+void relay_reset()
+{
+    int i;
+
+    pthread_mutex_lock(&relay_lock);
+    for (i = 0; i < MAX_SUBSCRIBERS; ++i)
+	subscribers[i].active = 0;
+    have_pat = have_pmt = 0;
+    pmt_pid = -1;
+    carry_len = 0;
+    pthread_mutex_unlock(&relay_lock);
+}
+
+int relay_init(const char* path)
+{
+    struct sockaddr_un addr;
+    int i;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+	fprintf(stderr, "relay socket path too long\n");
+	return -1;
+    }
+
+    if (pipe2(master, O_CLOEXEC | O_NONBLOCK) < 0
+	    || (devnull = open("/dev/null", O_WRONLY | O_CLOEXEC)) < 0) {
+	fprintf(stderr, "relay: %m\n");
+	return -1;
+    }
+
+    /* subscribers going away must not kill us */
+    signal(SIGPIPE, SIG_IGN);
+
+    listenfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listenfd < 0) {
+	fprintf(stderr, "failed to create relay socket: %m\n");
+	return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+
+    if (bind(listenfd, (struct sockaddr*)&addr, sizeof(addr)) < 0
+	    || listen(listenfd, 5) < 0) {
+	fprintf(stderr, "failed to listen on %s: %m\n", path);
+	close(listenfd);
+	listenfd = -1;
+	return -1;
+    }
+    socket_path = strdup(path);
+
+    for (i = 0; i < MAX_SUBSCRIBERS; ++i)
+	subscribers[i].fd = -1;
+
+    pthread_create(&relay_tid, NULL, _relay_accept, NULL);
+    return 0;
+}
+
+void relay_close()
+{
+    int i;
+
+    if (listenfd == -1)
+	return;
+
+    pthread_cancel(relay_tid);
+    pthread_join(relay_tid, NULL);
+    close(listenfd);
+    listenfd = -1;
+    unlink(socket_path);
+    free(socket_path);
+
+    for (i = 0; i < MAX_SUBSCRIBERS; ++i)
+	if (subscribers[i].fd != -1)
+	    drop_subscriber(&subscribers[i]);
+    close(master[0]);
+    close(master[1]);
+    close(devnull);
+}
+
+// vim: sw=4
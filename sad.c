@@ -0,0 +1,69 @@
+/*
+ * Copyright (c) 2017 SUSE LLC
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "sad.h"
+
+#include <stdlib.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+/* sum of absolute differences of two byte arrays. This runs over every
+ * changed pixel so it uses psadbw on x86 and vabd on ARM, the plain loop
+ * only handles the tail */
+uint64_t sad_u8(const uint8_t* a, const uint8_t* b, size_t n)
+{
+    uint64_t sum = 0;
+    size_t i = 0;
+
+#if defined(__SSE2__)
+    __m128i acc = _mm_setzero_si128();
+    uint64_t lanes[2];
+
+    for (; i + 16 <= n; i += 16) {
+	__m128i va = _mm_loadu_si128((const __m128i*)(a + i));
+	__m128i vb = _mm_loadu_si128((const __m128i*)(b + i));
+	acc = _mm_add_epi64(acc, _mm_sad_epu8(va, vb));
+    }
+    _mm_storeu_si128((__m128i*)lanes, acc);
+    sum = lanes[0] + lanes[1];
+#elif defined(__ARM_NEON)
+    uint32x4_t acc = vdupq_n_u32(0);
+
+    for (; i + 16 <= n; i += 16) {
+	uint8x16_t d = vabdq_u8(vld1q_u8(a + i), vld1q_u8(b + i));
+	acc = vpadalq_u16(acc, vpaddlq_u8(d));
+    }
+    sum = (uint64_t)vgetq_lane_u32(acc, 0) + vgetq_lane_u32(acc, 1)
+	+ vgetq_lane_u32(acc, 2) + vgetq_lane_u32(acc, 3);
+#endif
+
+    for (; i < n; ++i)
+	sum += abs(a[i] - b[i]);
+
+    return sum;
+}
+
+// vim: sw=4
@@ -0,0 +1,236 @@
+/*
+ * Copyright (c) 2017 SUSE LLC
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+#include "threads.h"
+
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* cpu affinity and scheduling per thread role, so several instances on one
+ * host don't get in each other's way. Spec is role:cpus[:fifo=prio|:nice=n]
+ * e.g. "capture:2-3:fifo=10". Threads started from a pinned thread inherit
+ * its placement, so memory the capture thread touches first (frame pools,
+ * decoder buffers) ends up on the local NUMA node. Role threads and helper
+ * threads without a policy of their own go back to what the process started
+ * with rather than keeping the one of whoever created them. */
+
+static const char* role_names[THREAD_ROLE_MAX] = {
+    [THREAD_RFB] = "rfb",
+    [THREAD_CAPTURE] = "capture",
+    [THREAD_CONTROL] = "control",
+};
+
+static struct {
+    int set;
+    int pin;
+    cpu_set_t cpus;
+    int fifo;
+    int nice;
+    pid_t tid;
+} policies[THREAD_ROLE_MAX];
+
+static cpu_set_t default_cpus;
+static int default_nice;
+static int any_set;
+
+static int format_role(int role, char* buf, size_t len);
+
+static int parse_cpus(const char* s, cpu_set_t* set)
+{
+    char* end;
+
+    CPU_ZERO(set);
+    while (*s) {
+	long from = strtol(s, &end, 10), to;
+	if (end == s || from < 0 || from >= CPU_SETSIZE)
+	    return -1;
+	to = from;
+	s = end;
+	if (*s == '-') {
+	    to = strtol(s + 1, &end, 10);
+	    if (end == s + 1 || to < from || to >= CPU_SETSIZE)
+		return -1;
+	    s = end;
+	}
+	for (; from <= to; ++from)
+	    CPU_SET(from, set);
+	if (*s == ',')
+	    ++s;
+	else if (*s)
+	    return -1;
+    }
+    return 0;
+}
+
+int thread_policy_parse(const char* spec)
+{
+    char* copy = strdup(spec);
+    char* role = strtok(copy, ":");
+    char* cpus = strtok(NULL, ":");
+    char* sched = strtok(NULL, ":");
+    int i;
+
+    /* still in the main thread with nothing applied yet */
+    if (!any_set) {
+	sched_getaffinity(0, sizeof(default_cpus), &default_cpus);
+	default_nice = getpriority(PRIO_PROCESS, 0);
+    }
+
+    for (i = 0; role && i < THREAD_ROLE_MAX; ++i)
+	if (!strcmp(role, role_names[i]))
+	    break;
+    if (!role || i == THREAD_ROLE_MAX) {
+	fprintf(stderr, "unknown thread role in '%s'\n", spec);
+	goto fail;
+    }
+
+    policies[i].pin = cpus && strcmp(cpus, "-");
+    if (policies[i].pin && parse_cpus(cpus, &policies[i].cpus) < 0) {
+	fprintf(stderr, "invalid cpu list in '%s'\n", spec);
+	goto fail;
+    }
+
+    if (sched) {
+	if (!strncmp(sched, "fifo=", 5))
+	    policies[i].fifo = atoi(sched + 5);
+	else if (!strncmp(sched, "nice=", 5))
+	    policies[i].nice = atoi(sched + 5);
+	else {
+	    fprintf(stderr, "invalid scheduling policy in '%s'\n", spec);
+	    goto fail;
+	}
+    }
+
+    policies[i].set = 1;
+    any_set = 1;
+    free(copy);
+    return 0;
+
+fail:
+    free(copy);
+    return -1;
+}
+
+void thread_policy_default()
+{
+    struct sched_param param = { .sched_priority = 0 };
+
+    if (!any_set)
+	return;
+
+    /* best effort, going back to a lower nice level may not be allowed */
+    pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &default_cpus);
+    pthread_setschedparam(pthread_self(), SCHED_OTHER, &param);
+    setpriority(PRIO_PROCESS, syscall(SYS_gettid), default_nice);
+}
+
+void thread_policy_apply(enum thread_role role)
+{
+    pid_t tid = syscall(SYS_gettid);
+
+    policies[role].tid = tid;
+    if (role != THREAD_RFB)
+	thread_policy_default();
+    if (!policies[role].set)
+	return;
+
+    if (policies[role].pin
+	    && pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &policies[role].cpus))
+	fprintf(stderr, "%s: failed to set cpu affinity\n", role_names[role]);
+
+    if (policies[role].fifo) {
+	struct sched_param param = { .sched_priority = policies[role].fifo };
+	if (pthread_setschedparam(pthread_self(), SCHED_FIFO, &param))
+	    fprintf(stderr, "%s: failed to set SCHED_FIFO\n", role_names[role]);
+    } else if (policies[role].nice) {
+	if (setpriority(PRIO_PROCESS, tid, policies[role].nice) < 0)
+	    fprintf(stderr, "%s: failed to set nice level: %m\n", role_names[role]);
+    }
+
+    {
+	char buf[256];
+	format_role(role, buf, sizeof(buf));
+	fputs(buf, stderr);
+    }
+}
+
+/* what the thread actually got, not what was asked for */
+static int format_role(int role, char* buf, size_t len)
+{
+    struct sched_param param;
+    cpu_set_t set;
+    int policy, cpu, n, first = 1;
+    size_t pos;
+
+    pos = snprintf(buf, len, "%s tid %d cpus", role_names[role], policies[role].tid);
+    if (!sched_getaffinity(policies[role].tid, sizeof(set), &set)) {
+	for (cpu = 0; cpu < CPU_SETSIZE && pos < len; ++cpu) {
+	    if (!CPU_ISSET(cpu, &set))
+		continue;
+	    pos += snprintf(buf + pos, len - pos, "%c%d", first ? ' ' : ',', cpu);
+	    first = 0;
+	}
+    }
+    if (pos >= len)
+	return len - 1;
+
+    policy = sched_getscheduler(policies[role].tid);
+    sched_getparam(policies[role].tid, &param);
+    if (policy == SCHED_FIFO)
+	n = snprintf(buf + pos, len - pos, " fifo %d\n", param.sched_priority);
+    else
+	n = snprintf(buf + pos, len - pos, " nice %d\n",
+		getpriority(PRIO_PROCESS, policies[role].tid));
+    pos += n;
+
+    return pos < len ? pos : len - 1;
+}
+
+/* the thread is gone, its tid may be reused by someone else */
+void thread_policy_forget(enum thread_role role)
+{
+    policies[role].tid = 0;
+}
+
+int thread_policy_report(char* buf, size_t len)
+{
+    size_t pos = 0;
+    int i;
+
+    buf[0] = 0;
+    for (i = 0; i < THREAD_ROLE_MAX && pos < len - 1; ++i) {
+	if (policies[i].tid)
+	    pos += format_role(i, buf + pos, len - pos);
+    }
+
+    return pos;
+}
+
+// vim: sw=4
@@ -22,10 +22,20 @@
  */
 
 #include "main.h"
+#include "calibrate.h"
+#include "framepool.h"
+#include "history.h"
+#include "needle.h"
+#include "probes.h"
+#include "relay.h"
+#include "sad.h"
+#include "threads.h"
 
 #include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
 #include <libavutil/samplefmt.h>
 #include <libavutil/timestamp.h>
+#include <libavutil/time.h>
 #include <libavformat/avformat.h>
 #include <libswscale/swscale.h>
 
@@ -37,6 +47,12 @@ static int do_capture;
 static int capturing;
 static int need_join;
 
+/* the capture runs as long as anybody wants pictures: vnc clients, control
+ * clients that polled thumbnails or added needles and relay subscribers */
+static int capture_users;
+static pthread_mutex_t users_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread int is_capture_thread;
+
 static AVFormatContext *fmt_ctx = NULL;
 static AVCodecContext *video_dec_ctx = NULL;
 static int width, height;
@@ -48,14 +64,124 @@ static uint8_t *video_dst_data[4] = {NULL};
 static int      video_dst_linesize[4];
 static int video_dst_bufsize;
 
+/* converted frames and decoder frames both come from preallocated pools, so
+ * once the capture is running no memory gets allocated per frame */
+#define FRAMEPOOL_BUFFERS 2
+#define JITTER_BUFFERS 8
+#define DECODER_ALIGN 128
+
+static AVBufferPool *dec_pool;
+static int dec_pool_size;
+static pthread_mutex_t dec_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static int video_stream_idx = -1;
 static AVFrame *frame = NULL;
 static AVPacket pkt;
 struct SwsContext *sws_ctx;
 
+/* downscaled copy of the picture for the control socket. It's scaled from
+ * the decoded frame with its own cached context and updated at most once
+ * per THUMB_INTERVAL so it costs next to nothing */
+#define THUMB_SCALE 8
+#define THUMB_INTERVAL 1000000
+
+static struct SwsContext *thumb_sws_ctx;
+static uint8_t *thumb_data[4] = {NULL};
+static int thumb_linesize[4];
+static int thumb_width, thumb_height;
+static int64_t thumb_time;
+static pthread_mutex_t thumb_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_mutex_t capture_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* many boards put a smaller picture with black borders into the 1080p
+ * signal. With autocrop the luma plane is sampled for the active area every
+ * AUTOCROP_INTERVAL and only that area is passed to the scaler. A new area
+ * has to be seen twice in a row before it's used. */
+#define AUTOCROP_INTERVAL 2000000
+#define AUTOCROP_BLACK 32
+#define AUTOCROP_STEP 8
+#define AUTOCROP_MIN_HITS 4
+
+struct rect {
+    int x, y, w, h;
+};
+
+static int autocrop;
+static int64_t autocrop_time;
+static struct rect crop, crop_candidate;
+
+/* optional jitter buffer. Converted frames are queued and presented on the
+ * source clock, pts mapped to local time plus a latency that is at least
+ * jitter_latency and grows with the measured jitter. The earliest arrival
+ * defines the clock, frames that are already late when a newer one is due
+ * are dropped instead of being shown for a few milliseconds. */
+#define JITTER_MAX_LATENCY 1000000
+#define JITTER_RESYNC 2000000
+
+struct queued_frame {
+    uint8_t *buf;
+    int64_t pts;
+    unsigned seq;
+    enum AVPixelFormat fmt;
+};
+
+static int64_t jitter_latency;
+static struct queued_frame jitter_queue[JITTER_BUFFERS];
+static int jitter_head, jitter_count;
+static int64_t jitter, clock_wall, clock_pts = AV_NOPTS_VALUE;
+static int frames_presented, frames_collapsed;
+
+/* sequence numbers for the tracepoints */
+static unsigned packet_seq, frame_seq;
+static int presenting;
+static pthread_t present_tid;
+static pthread_mutex_t jitter_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jitter_cond;
+
+/* the extender may reboot or the multicast stream may drop out. If no
+ * packet arrives for stall_timeout the blocking read is interrupted and the
+ * input gets reopened with backoff. */
+#define RECONNECT_MIN 100000
+#define RECONNECT_MAX 5000000
+
+static int64_t stall_timeout = 2000000;
+static int64_t last_activity;
+static int resync;
+static int recoveries;
+static int64_t last_recovery_time;
+
+/* per tile change map of the last update */
+static uint8_t *tile_dirty;
+static int tiles_x, tiles_y;
+
+/* H.264 noise makes tiny changes on static screens all the time. With a
+ * noise threshold a tile only counts as changed if the mean difference of
+ * one of its rows exceeds it, smaller differences are held back until they
+ * persisted for noise_frames frames */
+static int noise_threshold;
+static int noise_frames;
+static uint8_t *tile_hold;
+
 static int fb_width;
 static int fb_height;
 static int fb_depth;
+static enum AVPixelFormat fb_pix_fmt = AV_PIX_FMT_NONE;
+static rfbPixelFormat fb_server_format;
+/* set from the rfb thread when the clients want a different layout */
+static volatile enum AVPixelFormat next_fb_pix_fmt = AV_PIX_FMT_NONE;
+static rfbPixelFormat next_server_format;
+
+/* fb_pix_fmt is what frames get converted to, shown_pix_fmt what the
+ * framebuffer holds and the server format describes. The first frame in a
+ * new format is parked in switch_frame and the rfb thread swaps contents
+ * and server format between two updates, so clients never get one
+ * interpreted as the other. fb_lock serializes that with publishing */
+static enum AVPixelFormat shown_pix_fmt = AV_PIX_FMT_NONE;
+static uint8_t *switch_frame;
+static enum AVPixelFormat switch_fmt = AV_PIX_FMT_NONE;
+static rfbPixelFormat switch_server_format;
+static pthread_mutex_t fb_lock = PTHREAD_MUTEX_INITIALIZER;
 
 //#define DEBUG_PPM
 
@@ -68,8 +194,11 @@ static void ppm_save(const uint8_t *buf, int wrap, int xsize, int ysize, int dep
     int x, y;
 
     f = fopen(filename,"w");
-    fprintf(f, "P6\n%d %d 255\n", xsize, ysize);
-    if (depth == 24)
+    fprintf(f, "P%d\n%d %d 255\n", depth == 8 ? 5 : 6, xsize, ysize);
+    if (depth == 8)
+	for (y = 0; y < ysize; y++)
+	    fwrite(buf + y * wrap, 1, xsize, f);
+    else if (depth == 24)
 	for (y = 0; y < ysize; y++)
 	    fwrite(buf + y * wrap, 1, xsize*3, f);
     else
@@ -90,16 +219,528 @@ static void log_packet(const AVFormatContext *fmt_ctx, const AVPacket *pkt)
 	    pkt->stream_index);
 }
 
-static void update_framebuffer(const uint8_t *buf, int wrap, int xsize, int ysize, int depth)
+static int tile_changed(const uint8_t *src, int src_wrap, const uint8_t *dst,
+	int dst_wrap, int len, int h, uint8_t *hold)
+{
+    uint64_t sad, max = 0;
+    int y;
+
+    for (y = 0; y < h; ++y) {
+	sad = sad_u8(src + y * src_wrap, dst + y * dst_wrap, len);
+	if (sad > max)
+	    max = sad;
+    }
+
+    if (!max) {
+	*hold = 0;
+	return 0;
+    }
+    if (max > (uint64_t)noise_threshold * len
+	    || (noise_frames && ++*hold >= noise_frames)) {
+	*hold = 0;
+	return 1;
+    }
+    return 0;
+}
+
+/* only copy and announce tiles that actually changed. libvncserver has less
+ * to encode that way and the needle matching knows where to look */
+static int update_framebuffer(const uint8_t *buf, int wrap, int xsize, int ysize, int depth)
+{
+    uint8_t *fb = (uint8_t *)rfbScreen->frameBuffer;
+    int bpp = depth >> 3;
+    int fb_wrap = xsize * bpp;
+    int tx, ty, y;
+    int changed = 0;
+
+    for (ty = 0; ty < tiles_y; ++ty) {
+	int y0 = ty * TILE_SIZE;
+	int y1 = FFMIN(y0 + TILE_SIZE, ysize);
+	int run = -1;
+
+	for (tx = 0; tx < tiles_x; ++tx) {
+	    int x0 = tx * TILE_SIZE;
+	    int len = (FFMIN(x0 + TILE_SIZE, xsize) - x0) * bpp;
+	    int dirty = 0;
+
+	    if (noise_threshold)
+		dirty = tile_changed(buf + y0 * wrap + x0 * bpp, wrap,
+			fb + y0 * fb_wrap + x0 * bpp, fb_wrap, len, y1 - y0,
+			&tile_hold[ty * tiles_x + tx]);
+
+	    for (y = y0; y < y1 && (dirty || !noise_threshold); ++y) {
+		const uint8_t *src = buf + y * wrap + x0 * bpp;
+		uint8_t *dst = fb + y * fb_wrap + x0 * bpp;
+		if (dirty || memcmp(dst, src, len)) {
+		    memcpy(dst, src, len);
+		    dirty = 1;
+		}
+	    }
+
+	    tile_dirty[ty * tiles_x + tx] = dirty;
+	    changed += dirty;
+	    if (dirty && run < 0)
+		run = tx;
+	    if (!dirty && run >= 0) {
+		rfbMarkRectAsModified(rfbScreen, run * TILE_SIZE, y0, x0, y1);
+		run = -1;
+	    }
+	}
+	if (run >= 0)
+	    rfbMarkRectAsModified(rfbScreen, run * TILE_SIZE, y0, xsize, y1);
+    }
+
+    needle_check(fb, fb_wrap, shown_pix_fmt, tile_dirty, tiles_x);
+
+    return changed;
+}
+
+static void update_thumbnail(uint8_t *const data[4], const int linesize[4],
+	int w, int h, enum AVPixelFormat fmt)
+{
+    int64_t now = av_gettime_relative();
+
+    if (thumb_data[0] && now - thumb_time < THUMB_INTERVAL)
+	return;
+
+    pthread_mutex_lock(&thumb_lock);
+    if (!thumb_data[0]) {
+	thumb_width = fb_width / THUMB_SCALE;
+	thumb_height = fb_height / THUMB_SCALE;
+	if (av_image_alloc(thumb_data, thumb_linesize,
+		    thumb_width, thumb_height, AV_PIX_FMT_RGB24, 1) < 0) {
+	    fprintf(stderr, "Could not allocate thumbnail buffer\n");
+	    thumb_data[0] = NULL;
+	    goto out;
+	}
+    }
+
+    thumb_sws_ctx = sws_getCachedContext(thumb_sws_ctx,
+	    w, h, fmt,
+	    thumb_width, thumb_height, AV_PIX_FMT_RGB24,
+	    SWS_AREA, NULL, NULL, NULL);
+    if (!thumb_sws_ctx) {
+	fprintf(stderr, "Failed to create scale context for thumbnail\n");
+	goto out;
+    }
+
+    sws_scale(thumb_sws_ctx, (const uint8_t * const*)data, linesize,
+	    0, h, thumb_data, thumb_linesize);
+    thumb_time = now;
+
+out:
+    pthread_mutex_unlock(&thumb_lock);
+}
+
+/* encode an RGB24 picture as PNG. The result has to be freed with av_free */
+int video_encode_png(uint8_t *data, int linesize, int w, int h,
+	uint8_t **png, int *size)
+{
+    AVCodec *codec;
+    AVCodecContext *ctx = NULL;
+    AVFrame *f = NULL;
+    AVPacket out;
+    int ret = 0;
+
+    av_init_packet(&out);
+    out.data = NULL;
+    out.size = 0;
+
+    codec = avcodec_find_encoder(AV_CODEC_ID_PNG);
+    if (!codec) {
+	fprintf(stderr, "PNG encoder not available\n");
+	return 0;
+    }
+
+    ctx = avcodec_alloc_context3(codec);
+    f = av_frame_alloc();
+    if (!ctx || !f)
+	goto end;
+
+    ctx->width = w;
+    ctx->height = h;
+    ctx->pix_fmt = AV_PIX_FMT_RGB24;
+    ctx->time_base = (AVRational){1, 1};
+    if (avcodec_open2(ctx, codec, NULL) < 0) {
+	fprintf(stderr, "Failed to open PNG encoder\n");
+	goto end;
+    }
+
+    f->width = w;
+    f->height = h;
+    f->format = AV_PIX_FMT_RGB24;
+    f->data[0] = data;
+    f->linesize[0] = linesize;
+
+    if (avcodec_send_frame(ctx, f) < 0 || avcodec_receive_packet(ctx, &out) < 0) {
+	fprintf(stderr, "Failed to encode PNG\n");
+	goto end;
+    }
+
+    *png = av_malloc(out.size);
+    if (*png) {
+	memcpy(*png, out.data, out.size);
+	*size = out.size;
+	ret = 1;
+    }
+
+end:
+    av_packet_unref(&out);
+    av_frame_free(&f);
+    avcodec_free_context(&ctx);
+    return ret;
+}
+
+int video_get_thumbnail(uint8_t **png, int *size)
+{
+    uint8_t *copy;
+    int ret;
+
+    pthread_mutex_lock(&thumb_lock);
+    if (!thumb_data[0] || !thumb_time) {
+	pthread_mutex_unlock(&thumb_lock);
+	return 0;
+    }
+    /* don't hold the lock while encoding, the capture thread would stall */
+    copy = av_malloc(thumb_linesize[0] * thumb_height);
+    if (copy)
+	memcpy(copy, thumb_data[0], thumb_linesize[0] * thumb_height);
+    pthread_mutex_unlock(&thumb_lock);
+
+    if (!copy)
+	return 0;
+
+    ret = video_encode_png(copy, thumb_linesize[0], thumb_width, thumb_height, png, size);
+    av_free(copy);
+    return ret;
+}
+
+static int64_t frame_due(const struct queued_frame *f)
+{
+    int64_t latency = FFMIN(FFMAX(jitter_latency, 2 * jitter), JITTER_MAX_LATENCY);
+
+    if (f->pts == AV_NOPTS_VALUE)
+	return 0;
+    return clock_wall + f->pts - clock_pts + latency;
+}
+
+static void queue_frame(uint8_t *buf, int64_t pts, unsigned seq,
+	enum AVPixelFormat fmt)
+{
+    int64_t now = av_gettime_relative();
+    struct queued_frame *f;
+
+    pthread_mutex_lock(&jitter_lock);
+    if (pts != AV_NOPTS_VALUE) {
+	int64_t offset = now - (clock_wall + pts - clock_pts);
+
+	if (clock_pts == AV_NOPTS_VALUE || llabs(offset) > JITTER_RESYNC) {
+	    clock_wall = now;
+	    clock_pts = pts;
+	    jitter = 0;
+	} else if (offset < 0) {
+	    clock_wall += offset;
+	} else {
+	    jitter += (offset - jitter) / 16;
+	    /* follow clock drift between source and us slowly */
+	    clock_wall += offset / 1024;
+	}
+    }
+
+    f = &jitter_queue[(jitter_head + jitter_count) % JITTER_BUFFERS];
+    f->buf = buf;
+    f->pts = pts;
+    f->seq = seq;
+    f->fmt = fmt;
+    ++jitter_count;
+    pthread_cond_signal(&jitter_cond);
+    pthread_mutex_unlock(&jitter_lock);
+}
+
+/* all buffers are waiting, the oldest one is least interesting */
+static uint8_t *steal_queued_frame()
 {
-    memcpy(rfbScreen->frameBuffer, buf, xsize * ysize * (depth>>3));
-    rfbMarkRectAsModified(rfbScreen,0,0, xsize, ysize);
-    //usleep(500);
+    uint8_t *buf = NULL;
+
+    pthread_mutex_lock(&jitter_lock);
+    if (jitter_count) {
+	buf = jitter_queue[jitter_head].buf;
+	jitter_head = (jitter_head + 1) % JITTER_BUFFERS;
+	--jitter_count;
+	++frames_collapsed;
+    }
+    pthread_mutex_unlock(&jitter_lock);
+
+    return buf;
+}
+
+static void publish_frame(const uint8_t *buf, enum AVPixelFormat fmt, unsigned seq)
+{
+    int changed;
+
+    pthread_mutex_lock(&fb_lock);
+    if (fmt == shown_pix_fmt) {
+	changed = update_framebuffer(buf, video_dst_linesize[0],
+		fb_width, fb_height, fb_depth);
+	PROBE2(publish, seq, changed);
+    } else if (fmt == fb_pix_fmt) {
+	/* frames still queued in an older format are just dropped */
+	if (!switch_frame)
+	    switch_frame = av_malloc(video_dst_bufsize);
+	if (switch_frame) {
+	    memcpy(switch_frame, buf, video_dst_bufsize);
+	    switch_fmt = fmt;
+	    switch_server_format = fb_server_format;
+	}
+    }
+    pthread_mutex_unlock(&fb_lock);
+}
+
+/* called by the rfb thread between updates */
+void video_switch_fb_format()
+{
+    rfbClientIteratorPtr it;
+    rfbClientPtr c;
+    uint8_t *fb = (uint8_t *)rfbScreen->frameBuffer;
+    int fb_wrap = fb_width * (fb_depth >> 3);
+    int y;
+
+    pthread_mutex_lock(&fb_lock);
+    if (switch_fmt == AV_PIX_FMT_NONE) {
+	pthread_mutex_unlock(&fb_lock);
+	return;
+    }
+    for (y = 0; y < fb_height; ++y)
+	memcpy(fb + y * fb_wrap, switch_frame + y * video_dst_linesize[0], fb_wrap);
+    rfbScreen->serverFormat = switch_server_format;
+    shown_pix_fmt = switch_fmt;
+    switch_fmt = AV_PIX_FMT_NONE;
+    pthread_mutex_unlock(&fb_lock);
+
+    debug("switched framebuffer to %s\n", av_get_pix_fmt_name(shown_pix_fmt));
+    it = rfbGetClientIterator(rfbScreen);
+    while ((c = rfbClientIteratorNext(it)))
+	rfbSetTranslateFunction(c);
+    rfbReleaseClientIterator(it);
+    rfbMarkRectAsModified(rfbScreen, 0, 0, fb_width, fb_height);
+}
+
+static void *_present_frames(void *arg)
+{
+    pthread_mutex_lock(&jitter_lock);
+    while (presenting) {
+	struct queued_frame f = { NULL };
+	int64_t now = av_gettime_relative();
+	int64_t due;
+
+	if (!jitter_count) {
+	    pthread_cond_wait(&jitter_cond, &jitter_lock);
+	    continue;
+	}
+
+	due = frame_due(&jitter_queue[jitter_head]);
+	if (due > now) {
+	    struct timespec ts = { due / 1000000, (due % 1000000) * 1000 };
+	    pthread_cond_timedwait(&jitter_cond, &jitter_lock, &ts);
+	    continue;
+	}
+
+	/* of everything that is due only the newest frame is shown */
+	while (jitter_count && frame_due(&jitter_queue[jitter_head]) <= now) {
+	    if (f.buf) {
+		framepool_put(f.buf);
+		++frames_collapsed;
+	    }
+	    f = jitter_queue[jitter_head];
+	    jitter_head = (jitter_head + 1) % JITTER_BUFFERS;
+	    --jitter_count;
+	}
+	pthread_mutex_unlock(&jitter_lock);
+
+	publish_frame(f.buf, f.fmt, f.seq);
+	framepool_put(f.buf);
+
+	pthread_mutex_lock(&jitter_lock);
+	++frames_presented;
+    }
+
+    while (jitter_count) {
+	framepool_put(jitter_queue[jitter_head].buf);
+	jitter_head = (jitter_head + 1) % JITTER_BUFFERS;
+	--jitter_count;
+    }
+    pthread_mutex_unlock(&jitter_lock);
+
+    return NULL;
+}
+
+static void start_presenting()
+{
+    pthread_mutex_lock(&jitter_lock);
+    clock_pts = AV_NOPTS_VALUE;
+    presenting = 1;
+    pthread_mutex_unlock(&jitter_lock);
+    pthread_create(&present_tid, NULL, _present_frames, NULL);
+}
+
+static void stop_presenting()
+{
+    pthread_mutex_lock(&jitter_lock);
+    presenting = 0;
+    pthread_cond_signal(&jitter_cond);
+    pthread_mutex_unlock(&jitter_lock);
+    pthread_join(present_tid, NULL);
+}
+
+static int setup_scaler()
+{
+    sws_ctx = sws_getCachedContext(sws_ctx, crop.w, crop.h, pix_fmt,
+	    fb_width, fb_height, fb_pix_fmt,
+	    0, NULL, NULL, NULL);
+    if (!sws_ctx) {
+	fprintf(stderr, "Failed to create scale context for conversion\n");
+	return -1;
+    }
+    return 0;
+}
+
+static void reset_crop()
+{
+    crop.x = crop.y = 0;
+    crop.w = width;
+    crop.h = height;
+    crop_candidate = crop;
+}
+
+static int luma_content(const uint8_t *p, int stride, int n)
+{
+    int hits = 0;
+    int i;
+
+    for (i = 0; i < n; i += AUTOCROP_STEP) {
+	if (p[i * stride] > AUTOCROP_BLACK && ++hits >= AUTOCROP_MIN_HITS)
+	    return 1;
+    }
+    return 0;
+}
+
+/* the calibration area is given in framebuffer coordinates, map it through
+ * scaling and crop onto the luma plane */
+static void calibrate_source(AVFrame *frame)
+{
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(frame->format);
+    int x, y, w, h;
+    int sx, sy, sw, sh;
+
+    if (!calibrate_area(&x, &y, &w, &h))
+	return;
+    if (!desc || (desc->flags & AV_PIX_FMT_FLAG_RGB)
+	    || !(desc->flags & AV_PIX_FMT_FLAG_PLANAR) || desc->comp[0].depth != 8)
+	return;
+
+    sx = crop.x + (int64_t)x * crop.w / fb_width;
+    sy = crop.y + (int64_t)y * crop.h / fb_height;
+    sw = FFMAX((int64_t)w * crop.w / fb_width, 1);
+    sh = FFMAX((int64_t)h * crop.h / fb_height, 1);
+    calibrate_frame(frame->data[0] + sy * frame->linesize[0] + sx,
+	    frame->linesize[0], sw, sh);
+}
+
+/* only 8 bit planar yuv with a plane per component, so the first plane is
+ * luma and the chroma offsets are simple */
+static int detect_active_area(AVFrame *frame, struct rect *r)
+{
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(frame->format);
+    const uint8_t *y = frame->data[0];
+    int ls = frame->linesize[0];
+    int top, bottom, left, right;
+    int ax, ay;
+
+    if (!desc || (desc->flags & AV_PIX_FMT_FLAG_RGB)
+	    || !(desc->flags & AV_PIX_FMT_FLAG_PLANAR) || desc->nb_components < 3
+	    || desc->comp[0].depth != 8 || desc->comp[1].plane == desc->comp[2].plane)
+	return 0;
+
+    for (top = 0; top < frame->height; top += 2)
+	if (luma_content(y + top * ls, 1, frame->width))
+	    break;
+    /* all black, keep what we have */
+    if (top >= frame->height)
+	return 0;
+    for (bottom = frame->height - 1; bottom > top; bottom -= 2)
+	if (luma_content(y + bottom * ls, 1, frame->width))
+	    break;
+    for (left = 0; left < frame->width; left += 2)
+	if (luma_content(y + top * ls + left, ls, bottom - top + 1))
+	    break;
+    for (right = frame->width - 1; right > left; right -= 2)
+	if (luma_content(y + top * ls + right, ls, bottom - top + 1))
+	    break;
+
+    /* chroma planes have to start at a whole sample */
+    ax = 1 << desc->log2_chroma_w;
+    ay = 1 << desc->log2_chroma_h;
+    r->x = left & ~(ax - 1);
+    r->y = top & ~(ay - 1);
+    r->w = FFALIGN(right + 1 - r->x, ax);
+    r->h = FFALIGN(bottom + 1 - r->y, ay);
+    r->w = FFMIN(r->w, frame->width - r->x);
+    r->h = FFMIN(r->h, frame->height - r->y);
+
+    return 1;
+}
+
+static void update_crop(AVFrame *frame)
+{
+    int64_t now = av_gettime_relative();
+    struct rect r;
+
+    if (now - autocrop_time < AUTOCROP_INTERVAL)
+	return;
+    autocrop_time = now;
+
+    if (!detect_active_area(frame, &r))
+	return;
+
+    if (!memcmp(&r, &crop, sizeof(r))) {
+	crop_candidate = crop;
+	return;
+    }
+    if (memcmp(&r, &crop_candidate, sizeof(r))) {
+	crop_candidate = r;
+	return;
+    }
+
+    fprintf(stderr, "Active area changed to %dx%d+%d+%d\n", r.w, r.h, r.x, r.y);
+    crop = r;
+    if (setup_scaler() < 0)
+	reset_crop();
+}
+
+static void crop_frame(AVFrame *frame, uint8_t *data[4])
+{
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(frame->format);
+    int i;
+
+    for (i = 0; i < 4; ++i) {
+	int x = crop.x, y = crop.y;
+
+	data[i] = frame->data[i];
+	if (!data[i])
+	    continue;
+	if (i == 1 || i == 2) {
+	    x >>= desc->log2_chroma_w;
+	    y >>= desc->log2_chroma_h;
+	}
+	data[i] += y * frame->linesize[i] + x;
+    }
 }
 
 int decode_packet(AVPacket* pkt)
 {
     int ret = 0;
+    uint8_t *dst;
+    uint8_t *src[4];
 
     if (pkt->stream_index == video_stream_idx) {
         /* decode video frame */
@@ -116,6 +757,12 @@ int decode_packet(AVPacket* pkt)
             return ret;
         }
 
+	++frame_seq;
+	PROBE3(decode_done, frame_seq, frame->width, frame->height);
+
+	if (frame->width == width && frame->height == height)
+	    calibrate_source(frame);
+
 	// drop non key frames. make helps against artifacts
 	if (!frame->key_frame) {
 	    return 0;
@@ -134,25 +781,45 @@ int decode_packet(AVPacket* pkt)
 	    height = frame->height;
 	    pix_fmt = frame->format;
 
-	    sws_ctx = sws_getCachedContext(sws_ctx, width, height, pix_fmt,
-		    fb_depth, fb_height, (fb_depth == 32 ? AV_PIX_FMT_RGBA : AV_PIX_FMT_RGB24),
-		    0, NULL, NULL, NULL);
-	    if (!sws_ctx) {
-		fprintf(stderr, "Failed to create scale context for conversion\n");
+	    reset_crop();
+	    if (setup_scaler() < 0)
+		return -1;
+	}
+
+	if (next_fb_pix_fmt != AV_PIX_FMT_NONE && next_fb_pix_fmt != fb_pix_fmt) {
+	    pthread_mutex_lock(&fb_lock);
+	    fb_pix_fmt = next_fb_pix_fmt;
+	    fb_server_format = next_server_format;
+	    pthread_mutex_unlock(&fb_lock);
+	    if (setup_scaler() < 0)
 		return -1;
-	    }
 	}
 
+	if (autocrop)
+	    update_crop(frame);
+	crop_frame(frame, src);
+
 
 #ifdef DEBUG_PPM
 	printf("video_frame n:%d coded_n:%d\n",
 	       video_frame_count++, frame->coded_picture_number);
 #endif
 
+	dst = framepool_get();
+	if (!dst && jitter_latency)
+	    dst = steal_queued_frame();
+	if (!dst) {
+	    fprintf(stderr, "No free frame buffer, dropping frame\n");
+	    return -1;
+	}
+	av_image_fill_pointers(video_dst_data, fb_pix_fmt, fb_height, dst,
+		video_dst_linesize);
+
 	/* convert to destination format */
 	sws_scale(sws_ctx,
-		frame->data, frame->linesize, 0, frame->height,
+		(const uint8_t * const*)src, frame->linesize, 0, crop.h,
 		    video_dst_data, video_dst_linesize);
+	PROBE2(convert_done, frame_seq, video_dst_bufsize);
 
 #ifdef DEBUG_PPM
 	char fn[1024];
@@ -161,8 +828,17 @@ int decode_packet(AVPacket* pkt)
 	     fb_width, fb_height, fb_depth, fn);
 #endif
 
-	update_framebuffer(video_dst_data[0], video_dst_linesize[0],
-	     fb_width, fb_height, fb_depth);
+	update_thumbnail(src, frame->linesize, crop.w, crop.h, frame->format);
+
+	if (jitter_latency) {
+	    int64_t pts = frame->best_effort_timestamp;
+	    if (pts != AV_NOPTS_VALUE)
+		pts = av_rescale_q(pts, video_stream->time_base, AV_TIME_BASE_Q);
+	    queue_frame(dst, pts, frame_seq, fb_pix_fmt);
+	} else {
+	    publish_frame(dst, fb_pix_fmt, frame_seq);
+	    framepool_put(dst);
+	}
 
 
 
@@ -181,6 +857,70 @@ int decode_packet(AVPacket* pkt)
     return ret;
 }
 
+static void dec_buffer_free(void *opaque, uint8_t *data)
+{
+    framepool_release(data, (size_t)opaque);
+}
+
+static AVBufferRef *dec_buffer_alloc(void *opaque, int size)
+{
+    uint8_t *data = framepool_alloc(size);
+    AVBufferRef *buf;
+
+    if (!data)
+	return NULL;
+
+    buf = av_buffer_create(data, size, dec_buffer_free, (void*)(size_t)size, 0);
+    if (!buf)
+	framepool_release(data, size);
+    return buf;
+}
+
+/* like avcodec_default_get_buffer2 but the planes live in one huge page
+ * backed, cache line aligned buffer from our own pool. The pool survives
+ * reconnects and capture restarts, it's only recreated if the frame size
+ * changes */
+static int dec_get_buffer2(AVCodecContext *s, AVFrame *f, int flags)
+{
+    int linesize_align[AV_NUM_DATA_POINTERS];
+    int linesize[4];
+    uint8_t *data[4];
+    int w = f->width;
+    int h = f->height;
+    int size, i;
+
+    avcodec_align_dimensions2(s, &w, &h, linesize_align);
+    if (av_image_fill_linesizes(linesize, f->format, FFALIGN(w, DECODER_ALIGN)) < 0)
+	return avcodec_default_get_buffer2(s, f, flags);
+    for (i = 0; i < 4; ++i) {
+	if (linesize_align[i] && linesize[i] % linesize_align[i])
+	    return avcodec_default_get_buffer2(s, f, flags);
+    }
+
+    size = av_image_fill_pointers(data, f->format, h, NULL, linesize);
+    if (size < 0)
+	return avcodec_default_get_buffer2(s, f, flags);
+    size += DECODER_ALIGN;
+
+    pthread_mutex_lock(&dec_pool_lock);
+    if (!dec_pool || size != dec_pool_size) {
+	av_buffer_pool_uninit(&dec_pool);
+	dec_pool = av_buffer_pool_init2(size, NULL, dec_buffer_alloc, NULL);
+	dec_pool_size = size;
+    }
+    f->buf[0] = dec_pool ? av_buffer_pool_get(dec_pool) : NULL;
+    pthread_mutex_unlock(&dec_pool_lock);
+
+    if (!f->buf[0])
+	return AVERROR(ENOMEM);
+
+    av_image_fill_pointers(f->data, f->format, h, f->buf[0]->data, linesize);
+    for (i = 0; i < 4; ++i)
+	f->linesize[i] = linesize[i];
+
+    return 0;
+}
+
 static int open_codec_context(int *stream_idx,
                               AVCodecContext **dec_ctx, AVFormatContext *fmt_ctx, enum AVMediaType type)
 {
@@ -221,6 +961,13 @@ static int open_codec_context(int *stream_idx,
             return ret;
         }
 
+        if (dec->capabilities & AV_CODEC_CAP_DR1) {
+            (*dec_ctx)->get_buffer2 = dec_get_buffer2;
+#if FF_API_THREAD_SAFE_CALLBACKS
+            (*dec_ctx)->thread_safe_callbacks = 1;
+#endif
+        }
+
         /* Init the decoders, without reference counting */
         av_dict_set(&opts, "refcounted_frames", "0", 0);
         if ((ret = avcodec_open2(*dec_ctx, dec, &opts)) < 0) {
@@ -234,8 +981,132 @@ static int open_codec_context(int *stream_idx,
     return 0;
 }
 
+/* map the framebuffer depth to the format the scaler writes. 16 and 8 bit
+ * trade colors for memory and bandwidth, the conversion from YUV happens in
+ * the same sws_scale call as the scaling so it costs nothing extra */
+static enum AVPixelFormat depth_to_pix_fmt(int depth)
+{
+    switch (depth) {
+	case 32:
+	    return AV_PIX_FMT_RGBA;
+	case 16:
+	    return AV_PIX_FMT_RGB565;
+	case 8:
+	    return AV_PIX_FMT_GRAY8;
+    }
+    return AV_PIX_FMT_NONE;
+}
+
+/* byte position of a channel in a 32 bit pixel */
+static int channel_byte(const rfbPixelFormat *f, int shift)
+{
+    return f->bigEndian ? 3 - shift / 8 : shift / 8;
+}
+
+static enum AVPixelFormat rfb_to_pix_fmt(const rfbPixelFormat *f)
+{
+    if (!f->trueColour)
+	return AV_PIX_FMT_NONE;
+
+    if (f->bitsPerPixel == 32 && f->redMax == 255 && f->greenMax == 255
+	    && f->blueMax == 255 && f->redShift % 8 == 0
+	    && f->greenShift % 8 == 0 && f->blueShift % 8 == 0) {
+	int r = channel_byte(f, f->redShift);
+	int g = channel_byte(f, f->greenShift);
+	int b = channel_byte(f, f->blueShift);
+
+	if (r == 0 && g == 1 && b == 2)
+	    return AV_PIX_FMT_RGBA;
+	if (b == 0 && g == 1 && r == 2)
+	    return AV_PIX_FMT_BGRA;
+	if (r == 1 && g == 2 && b == 3)
+	    return AV_PIX_FMT_ARGB;
+	if (b == 1 && g == 2 && r == 3)
+	    return AV_PIX_FMT_ABGR;
+    } else if (f->bitsPerPixel == 16 && f->redMax == 31 && f->blueMax == 31
+	    && f->greenShift == 5) {
+	int rgb = f->redShift > f->blueShift;
+	int hi = FFMAX(f->redShift, f->blueShift);
+
+	/* one of red and blue at the bottom, the other one above green */
+	if (FFMIN(f->redShift, f->blueShift) != 0)
+	    return AV_PIX_FMT_NONE;
+	if (f->greenMax == 63 && hi == 11)
+	    return f->bigEndian ? (rgb ? AV_PIX_FMT_RGB565BE : AV_PIX_FMT_BGR565BE)
+				: (rgb ? AV_PIX_FMT_RGB565LE : AV_PIX_FMT_BGR565LE);
+	if (f->greenMax == 31 && hi == 10)
+	    return f->bigEndian ? (rgb ? AV_PIX_FMT_RGB555BE : AV_PIX_FMT_BGR555BE)
+				: (rgb ? AV_PIX_FMT_RGB555LE : AV_PIX_FMT_BGR555LE);
+    }
+
+    return AV_PIX_FMT_NONE;
+}
+
+/* convert straight into the pixel format the clients asked for instead of
+ * letting libvncserver translate every pixel for them. Only layouts with
+ * the same size as the framebuffer can be switched to. Takes effect with
+ * the next converted frame, see video_switch_fb_format */
+int video_set_fb_format(const rfbPixelFormat *format)
+{
+    enum AVPixelFormat fmt;
+
+    if (fb_pix_fmt == AV_PIX_FMT_NONE || format->bitsPerPixel != fb_depth)
+	return 0;
+
+    fmt = rfb_to_pix_fmt(format);
+    if (fmt == AV_PIX_FMT_NONE)
+	return 0;
+
+    pthread_mutex_lock(&fb_lock);
+    next_server_format = *format;
+    next_fb_pix_fmt = fmt;
+    pthread_mutex_unlock(&fb_lock);
+    return 1;
+}
+
+void video_set_noise_filter(int threshold, int frames)
+{
+    noise_threshold = threshold;
+    noise_frames = FFMIN(frames, 255);
+}
+
+void video_set_autocrop(int enable)
+{
+    autocrop = enable;
+}
+
+void video_set_stall_timeout(int ms)
+{
+    stall_timeout = ms * 1000LL;
+}
+
+void video_set_jitter_latency(int ms)
+{
+    jitter_latency = ms * 1000LL;
+}
+
+int video_format_stats(char *buf, size_t len)
+{
+    return snprintf(buf, len,
+	    "capturing %d\n"
+	    "recoveries %d\n"
+	    "last_recovery_ms %lld\n"
+	    "jitter_ms %lld\n"
+	    "frames_presented %d\n"
+	    "frames_collapsed %d\n",
+	    capturing, recoveries,
+	    (long long)(last_recovery_time / 1000),
+	    (long long)(jitter / 1000),
+	    frames_presented, frames_collapsed);
+}
+
 int video_init (int width, int height, int depth, const char* url)
 {
+    if (depth_to_pix_fmt(depth) == AV_PIX_FMT_NONE) {
+	fprintf(stderr, "unsupported framebuffer depth %d\n", depth);
+	return 0;
+    }
+
     if(src_filename)
 	free(src_filename);
 
@@ -248,6 +1119,30 @@ int video_init (int width, int height, int depth, const char* url)
     fb_width = width;
     fb_height = height;
     fb_depth = depth;
+    fb_pix_fmt = depth_to_pix_fmt(depth);
+    shown_pix_fmt = fb_pix_fmt;
+    fb_server_format = rfbScreen->serverFormat;
+
+    tiles_x = (fb_width + TILE_SIZE - 1) / TILE_SIZE;
+    tiles_y = (fb_height + TILE_SIZE - 1) / TILE_SIZE;
+    free(tile_dirty);
+    free(tile_hold);
+    tile_dirty = calloc(tiles_x * tiles_y, 1);
+    tile_hold = calloc(tiles_x * tiles_y, 1);
+    if (!tile_dirty || !tile_hold)
+	return 0;
+
+    av_image_fill_linesizes(video_dst_linesize, fb_pix_fmt, fb_width);
+    video_dst_bufsize = av_image_get_buffer_size(fb_pix_fmt, fb_width, fb_height, 1);
+
+    /* timed waits of the presenter are against av_gettime_relative */
+    {
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&jitter_cond, &attr);
+	pthread_condattr_destroy(&attr);
+    }
 
     /* register all formats and codecs */
     av_register_all();
@@ -256,27 +1151,172 @@ int video_init (int width, int height, int depth, const char* url)
     return 1;
 }
 
+static int capture_interrupted(void *opaque)
+{
+    return !do_capture || av_gettime_relative() - last_activity > stall_timeout;
+}
+
+/* the input is read through our own AVIOContext. Every chunk that arrives
+ * counts as activity for the stall detection, also while probing, and with
+ * the relay enabled the raw transport stream is passed on before it's
+ * demuxed */
+#define INPUT_IO_SIZE 32768
+
+static AVIOContext *src_io;
+
+static int input_read(void *opaque, uint8_t *buf, int size)
+{
+    int ret = avio_read_partial(src_io, buf, size);
+
+    if (ret == 0)
+	return AVERROR_EOF;
+    if (ret > 0) {
+	last_activity = av_gettime_relative();
+	relay_feed(buf, ret, video_stream ? video_stream->id : -1);
+    }
+    return ret;
+}
+
+static void free_input_io(AVIOContext **pb)
+{
+    if (*pb) {
+	av_freep(&(*pb)->buffer);
+	avio_context_free(pb);
+    }
+    avio_closep(&src_io);
+}
+
+static int open_input()
+{
+    AVIOContext *pb = NULL;
+    uint8_t *buf;
+    int ret;
+
+    fmt_ctx = avformat_alloc_context();
+    if (!fmt_ctx)
+	return AVERROR(ENOMEM);
+
+    fmt_ctx->interrupt_callback.callback = capture_interrupted;
+    last_activity = av_gettime_relative();
+
+    ret = avio_open2(&src_io, src_filename, AVIO_FLAG_READ,
+	    &fmt_ctx->interrupt_callback, NULL);
+    if (ret < 0) {
+	avformat_free_context(fmt_ctx);
+	fmt_ctx = NULL;
+	return ret;
+    }
+    buf = av_malloc(INPUT_IO_SIZE);
+    if (buf)
+	pb = avio_alloc_context(buf, INPUT_IO_SIZE, 0, NULL, input_read, NULL, NULL);
+    if (!pb) {
+	av_free(buf);
+	free_input_io(&pb);
+	avformat_free_context(fmt_ctx);
+	fmt_ctx = NULL;
+	return AVERROR(ENOMEM);
+    }
+    fmt_ctx->pb = pb;
+    fmt_ctx->flags |= AVFMT_FLAG_CUSTOM_IO;
+
+    ret = avformat_open_input(&fmt_ctx, src_filename, NULL, NULL);
+    if (ret < 0)
+	free_input_io(&pb);
+    return ret;
+}
+
+static void close_input()
+{
+    AVIOContext *pb = NULL;
+
+    if (fmt_ctx && (fmt_ctx->flags & AVFMT_FLAG_CUSTOM_IO))
+	pb = fmt_ctx->pb;
+    /* the stream goes with the context, input_read must not look at it
+     * while the next input is opened */
+    video_stream = NULL;
+    video_stream_idx = -1;
+    avformat_close_input(&fmt_ctx);
+    if (pb) {
+	free_input_io(&pb);
+	relay_reset();
+    }
+}
+
+static void backoff_sleep(int64_t usec)
+{
+    int64_t end = av_gettime_relative() + usec;
+
+    while (do_capture && av_gettime_relative() < end)
+	av_usleep(10000);
+}
+
+/* the board may just be booting or the extender rebooting, keep trying
+ * instead of giving up until the next client comes along */
+static int open_with_backoff(int probe)
+{
+    int64_t delay = RECONNECT_MIN;
+
+    while (do_capture) {
+	if (open_input() < 0) {
+	    fprintf(stderr, "Could not open %s, retrying in %lldms\n",
+		    src_filename, (long long)(delay / 1000));
+	} else if (probe && avformat_find_stream_info(fmt_ctx, NULL) < 0) {
+	    fprintf(stderr, "Could not find stream information, retrying in %lldms\n",
+		    (long long)(delay / 1000));
+	    close_input();
+	} else {
+	    return 0;
+	}
+	backoff_sleep(delay);
+	delay = FFMIN(delay * 2, RECONNECT_MAX);
+    }
+
+    return -1;
+}
+
+/* keep the decoder and the last picture on screen, only reopen the input.
+ * Probing the stream again is not needed as the decoder is still set up,
+ * the video stream gets picked up again from the first packet and decoding
+ * resumes at the next key frame */
+static int reconnect()
+{
+    close_input();
+    avcodec_flush_buffers(video_dec_ctx);
+    resync = 1;
+
+    /* timestamps of the new stream have nothing to do with the old ones */
+    pthread_mutex_lock(&jitter_lock);
+    clock_pts = AV_NOPTS_VALUE;
+    pthread_mutex_unlock(&jitter_lock);
+
+    return open_with_backoff(0);
+}
+
 void _video_capture()
 {
     int ret = 0;
+    int64_t lost_at = 0;
 
     debug("");
 
-    assert(fb_depth == 32 || fb_depth == 24);
+    is_capture_thread = 1;
+    assert(fb_pix_fmt != AV_PIX_FMT_NONE);
+
+    thread_policy_apply(THREAD_CAPTURE);
 
-    /* open input file, and allocate format context */
-    if (avformat_open_input(&fmt_ctx, src_filename, NULL, NULL) < 0) {
-        fprintf(stderr, "Could not open source file %s\n", src_filename);
+    /* allocated from the capture thread so the memory is local to the cpus
+     * it's pinned to. Only happens on the first capture */
+    if (framepool_init(video_dst_bufsize,
+		jitter_latency ? JITTER_BUFFERS : FRAMEPOOL_BUFFERS) < 0)
 	goto end;
-    }
 
-    /* retrieve stream information */
-    if (avformat_find_stream_info(fmt_ctx, NULL) < 0) {
-        fprintf(stderr, "Could not find stream information\n");
+    /* open input file, allocate format context and retrieve stream
+     * information */
+    if (open_with_backoff(1) < 0)
 	goto end;
-    }
 
-    do_capture = 1;
+    video_stream = NULL;
+    resync = 0;
 
     if (open_codec_context(&video_stream_idx, &video_dec_ctx, fmt_ctx, AVMEDIA_TYPE_VIDEO) >= 0) {
         video_stream = fmt_ctx->streams[video_stream_idx];
@@ -293,40 +1333,71 @@ void _video_capture()
         goto end;
     }
 
-    ret = av_image_alloc(video_dst_data, video_dst_linesize,
-			 fb_width, fb_height, (fb_depth == 32 ? AV_PIX_FMT_RGBA : AV_PIX_FMT_RGB24), 1);
-    if (ret < 0) {
-	fprintf(stderr, "Could not allocate raw video buffer\n");
-	goto end;
-    }
-    video_dst_bufsize = ret;
-
     /* dump input information to stderr */
     av_dump_format(fmt_ctx, 0, src_filename, 0);
 
-    sws_ctx = sws_getContext(width, height, pix_fmt,
-                             fb_width, fb_height, (fb_depth == 32 ? AV_PIX_FMT_RGBA : AV_PIX_FMT_RGB24),
-                             0, NULL, NULL, NULL);
-    if (!sws_ctx) {
-        fprintf(stderr, "Failed to create scale context for conversion\n");
+    history_reset(video_stream->codecpar);
+
+    reset_crop();
+    if (setup_scaler() < 0) {
         ret = 1;
         goto end;
     }
 
-    frame = av_frame_alloc();
+    if (!frame)
+	frame = av_frame_alloc();
     if (!frame) {
         fprintf(stderr, "Could not allocate frame\n");
         ret = AVERROR(ENOMEM);
         goto end;
     }
 
+    if (jitter_latency)
+	start_presenting();
+
     /* initialize packet, set data to NULL, let the demuxer fill it */
     av_init_packet(&pkt);
     pkt.data = NULL;
     pkt.size = 0;
 
     /* read frames from the file */
-    while (do_capture && av_read_frame(fmt_ctx, &pkt) >= 0) {
+    while (do_capture) {
+	ret = av_read_frame(fmt_ctx, &pkt);
+	if (ret < 0) {
+	    if (ret == AVERROR_EOF || !do_capture)
+		break;
+	    fprintf(stderr, "Lost input stream (%s), reconnecting\n", av_err2str(ret));
+	    lost_at = last_activity;
+	    if (reconnect() < 0)
+		break;
+	    continue;
+	}
+	PROBE3(packet_read, ++packet_seq, pkt.stream_index, pkt.size);
+
+	if (video_stream_idx < 0) {
+	    AVStream *st = fmt_ctx->streams[pkt.stream_index];
+	    if (st->codecpar->codec_type == AVMEDIA_TYPE_VIDEO
+		    && st->codecpar->codec_id == video_dec_ctx->codec_id) {
+		video_stream_idx = pkt.stream_index;
+		video_stream = st;
+	    }
+	}
+
+	if (resync && pkt.stream_index == video_stream_idx) {
+	    if (!(pkt.flags & AV_PKT_FLAG_KEY)) {
+		av_packet_unref(&pkt);
+		continue;
+	    }
+	    resync = 0;
+	    ++recoveries;
+	    last_recovery_time = last_activity - lost_at;
+	    fprintf(stderr, "Input stream recovered after %lldms\n",
+		    (long long)(last_recovery_time / 1000));
+	}
+
+	if (pkt.stream_index == video_stream_idx)
+	    history_add(&pkt);
+
 	//log_packet(fmt_ctx, &pkt);
 	decode_packet(&pkt);
         av_packet_unref(&pkt);
@@ -337,51 +1408,129 @@ void _video_capture()
     pkt.size = 0;
     decode_packet(&pkt);
 
+    if (jitter_latency)
+	stop_presenting();
+
     printf("Demuxing done.\n");
 
     ret = 0;
 
 end:
     video_free();
+    thread_policy_forget(THREAD_CAPTURE);
     capturing = 0;
     pthread_exit(ret);
 }
 
-int video_start_capture()
+static int video_start_capture()
 {
     if (!src_filename) {
 	debug("video not initialized\n");
 	return 0;
     }
-    if (capturing) {
+    pthread_mutex_lock(&capture_lock);
+    if (capturing && do_capture) {
+	pthread_mutex_unlock(&capture_lock);
 	debug("already capturing\n");
 	return 0;
     }
+    if (need_join) {
+	/* previous capture thread gave up on its own or is on its way out */
+	pthread_join(capture_tid, NULL);
+	need_join = 0;
+    }
     capturing = 1;
     need_join = 1;
+    do_capture = 1;
     pthread_create(&capture_tid, NULL, _video_capture, NULL);
+    pthread_mutex_unlock(&capture_lock);
     return 1;
 }
 
-int video_stop_capture()
+static int video_stop_capture()
 {
+    pthread_mutex_lock(&capture_lock);
+    /* somebody came back while we waited for the lock */
+    pthread_mutex_lock(&users_lock);
+    if (capture_users) {
+	pthread_mutex_unlock(&users_lock);
+	pthread_mutex_unlock(&capture_lock);
+	return 0;
+    }
     do_capture = 0;
+    pthread_mutex_unlock(&users_lock);
     if (need_join) {
 	if (!capturing)
 	    debug("capture thread exited too early\n");
 	pthread_join(capture_tid, NULL);
 	need_join = 0;
     }
+    pthread_mutex_unlock(&capture_lock);
 
     return 1;
 }
 
+void video_hold_capture()
+{
+    pthread_mutex_lock(&users_lock);
+    ++capture_users;
+    pthread_mutex_unlock(&users_lock);
+    video_start_capture();
+}
+
+/* returns how many users are left */
+int video_release_capture()
+{
+    int left, stop;
+
+    pthread_mutex_lock(&users_lock);
+    left = --capture_users;
+    stop = !left;
+    /* e.g. the last relay subscriber went away while being fed. The capture
+     * thread can't join itself, it just winds down. Under the lock so that
+     * a concurrent hold sees it and starts a new one */
+    if (stop && is_capture_thread) {
+	do_capture = 0;
+	stop = 0;
+    }
+    pthread_mutex_unlock(&users_lock);
+
+    if (stop)
+	video_stop_capture();
+    return left;
+}
+
 void video_free()
 {
     avcodec_free_context(&video_dec_ctx);
-    avformat_close_input(&fmt_ctx);
+    close_input();
+    /* a dead board must not keep serving its last picture */
+    pthread_mutex_lock(&thumb_lock);
+    thumb_time = 0;
+    pthread_mutex_unlock(&thumb_lock);
+    /* frame, scaler and buffer pools are kept for the next capture */
+    if (frame)
+	av_frame_unref(frame);
+}
+
+/* at exit, whoever still holds the capture */
+void video_close()
+{
+    pthread_mutex_lock(&capture_lock);
+    do_capture = 0;
+    if (need_join) {
+	pthread_join(capture_tid, NULL);
+	need_join = 0;
+    }
+    pthread_mutex_unlock(&capture_lock);
+
     av_frame_free(&frame);
-    av_free(video_dst_data[0]);
+    sws_freeContext(sws_ctx);
+    sws_ctx = NULL;
+    pthread_mutex_lock(&dec_pool_lock);
+    av_buffer_pool_uninit(&dec_pool);
+    pthread_mutex_unlock(&dec_pool_lock);
+    framepool_cleanup();
 }
 
 // vim: sw=4
@@ -21,6 +21,9 @@
  */
 
 #include "main.h"
+#include "control.h"
+#include "probes.h"
+#include "threads.h"
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -29,6 +32,8 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
+#include <pthread.h>
+#include <errno.h>
 
 /* links
  * https://www.kernel.org/doc/Documentation/usb/gadget_configfs.txt
@@ -54,6 +59,10 @@ static struct {
     uint8_t key[6];
 } keystate;
 
+/* keystate and the device are shared between vnc key events and the
+ * typing thread */
+static pthread_mutex_t hid_lock = PTHREAD_MUTEX_INITIALIZER;
+
 int usbhid_init(const char* fn)
 {
     _fd = open (fn, O_RDWR | O_NOCTTY);
@@ -166,11 +175,13 @@ static uint8_t _keymap_latin1_base[XK_asciitilde-XK_space+1] = {
 void usbhid_handle_key(rfbBool down, rfbKeySym key, rfbClientPtr cl)
 {
     uint8_t code = 0;
+    int ret;
 
     if (_fd == -1)
 	return;
 
-    fprintf(stderr, "key %s 0x%04x\n", down?"press":"release", key);
+    debug("key %s 0x%04x\n", down?"press":"release", key);
+    pthread_mutex_lock(&hid_lock);
     switch (key) {
 	/* 0x020 */
 	case XK_space ... XK_asciitilde:
@@ -249,6 +260,7 @@ void usbhid_handle_key(rfbBool down, rfbKeySym key, rfbClientPtr cl)
 	    code = 0x49;
 	    break;
 	default:
+	    pthread_mutex_unlock(&hid_lock);
 	    fprintf(stderr, "unhandled key %s 0x%04x\n", down?"press":"release", key);
 	    return;
     }
@@ -273,7 +285,258 @@ void usbhid_handle_key(rfbBool down, rfbKeySym key, rfbClientPtr cl)
 	}
     }
 
-    write(_fd, &keystate, sizeof(keystate));
+    ret = write(_fd, &keystate, sizeof(keystate));
+    PROBE2(hid_report, &keystate, ret);
+    pthread_mutex_unlock(&hid_lock);
+}
+
+/* typing whole strings on the server side. The string is turned into the
+ * complete sequence of reports up front and a separate thread writes them
+ * back to back; the gadget blocks each write until the host polled the
+ * previous report, so this runs at the highest rate the host accepts. */
+
+#define MOD_SHIFT 0x02
+#define MOD_ALTGR 0x40
+#define DEAD 0x80
+
+struct layout_key {
+    uint32_t ch;
+    uint8_t code;
+    uint8_t mods;
+};
+
+static const struct layout_key _layout_us[] = {
+    { '\n', 0x28, 0 },
+    { '\t', 0x2b, 0 },
+};
+
+/* german, ascii plus the usual extras. ^ and ` are dead keys */
+static const struct layout_key _layout_de[] = {
+    { '\n', 0x28, 0 }, { '\t', 0x2b, 0 }, { ' ', 0x2c, 0 },
+    { '!', 0x1e, MOD_SHIFT }, { '"', 0x1f, MOD_SHIFT }, { '#', 0x32, 0 },
+    { '$', 0x21, MOD_SHIFT }, { '%', 0x22, MOD_SHIFT }, { '&', 0x23, MOD_SHIFT },
+    { '\'', 0x32, MOD_SHIFT }, { '(', 0x25, MOD_SHIFT }, { ')', 0x26, MOD_SHIFT },
+    { '*', 0x30, MOD_SHIFT }, { '+', 0x30, 0 }, { ',', 0x36, 0 },
+    { '-', 0x38, 0 }, { '.', 0x37, 0 }, { '/', 0x24, MOD_SHIFT },
+    { '0', 0x27, 0 }, { '1', 0x1e, 0 }, { '2', 0x1f, 0 }, { '3', 0x20, 0 },
+    { '4', 0x21, 0 }, { '5', 0x22, 0 }, { '6', 0x23, 0 }, { '7', 0x24, 0 },
+    { '8', 0x25, 0 }, { '9', 0x26, 0 },
+    { ':', 0x37, MOD_SHIFT }, { ';', 0x36, MOD_SHIFT }, { '<', 0x64, 0 },
+    { '=', 0x27, MOD_SHIFT }, { '>', 0x64, MOD_SHIFT }, { '?', 0x2d, MOD_SHIFT },
+    { '@', 0x14, MOD_ALTGR }, { '[', 0x25, MOD_ALTGR }, { '\\', 0x2d, MOD_ALTGR },
+    { ']', 0x26, MOD_ALTGR }, { '^', 0x35, DEAD }, { '_', 0x38, MOD_SHIFT },
+    { '`', 0x2e, MOD_SHIFT|DEAD }, { '{', 0x24, MOD_ALTGR }, { '|', 0x64, MOD_ALTGR },
+    { '}', 0x27, MOD_ALTGR }, { '~', 0x30, MOD_ALTGR },
+    { 0xe4, 0x34, 0 }, { 0xf6, 0x33, 0 }, { 0xfc, 0x2f, 0 },
+    { 0xc4, 0x34, MOD_SHIFT }, { 0xd6, 0x33, MOD_SHIFT }, { 0xdc, 0x2f, MOD_SHIFT },
+    { 0xdf, 0x2d, 0 }, { 0xa7, 0x20, MOD_SHIFT }, { 0xb0, 0x35, MOD_SHIFT },
+    { 0xb5, 0x10, MOD_ALTGR }, { 0x20ac, 0x08, MOD_ALTGR },
+};
+
+static int lookup_us(uint32_t ch, uint8_t* code, uint8_t* mods)
+{
+    int i;
+
+    for (i = 0; i < DIMOF(_layout_us); ++i) {
+	if (_layout_us[i].ch == ch) {
+	    *code = _layout_us[i].code;
+	    *mods = _layout_us[i].mods;
+	    return 1;
+	}
+    }
+    if (ch < XK_space || ch > XK_asciitilde)
+	return 0;
+
+    /* same table as for vnc key events, those get shift separately */
+    *code = _keymap_latin1_base[ch - XK_space];
+    *mods = (ch >= 'A' && ch <= 'Z') || strchr("~!@#$%^&*()_+{}|:\"<>?", ch) ? MOD_SHIFT : 0;
+    return 1;
+}
+
+static int lookup_de(uint32_t ch, uint8_t* code, uint8_t* mods)
+{
+    int i;
+
+    for (i = 0; i < DIMOF(_layout_de); ++i) {
+	if (_layout_de[i].ch == ch) {
+	    *code = _layout_de[i].code;
+	    *mods = _layout_de[i].mods;
+	    return 1;
+	}
+    }
+
+    if ((ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z')) {
+	uint32_t lower = ch | 0x20;
+	if (lower == 'y')
+	    *code = 0x1d;
+	else if (lower == 'z')
+	    *code = 0x1c;
+	else
+	    *code = 0x04 + lower - 'a';
+	*mods = ch < 'a' ? MOD_SHIFT : 0;
+	return 1;
+    }
+    return 0;
+}
+
+static const struct {
+    const char* name;
+    int (*lookup)(uint32_t ch, uint8_t* code, uint8_t* mods);
+} layouts[] = {
+    { "us", lookup_us },
+    { "de", lookup_de },
+};
+
+static uint32_t utf8_next(const char** s)
+{
+    const uint8_t* p = (const uint8_t*)*s;
+    uint32_t ch;
+    int n, i;
+
+    if (p[0] < 0x80) {
+	*s += 1;
+	return p[0];
+    } else if ((p[0] & 0xe0) == 0xc0) {
+	ch = p[0] & 0x1f;
+	n = 1;
+    } else if ((p[0] & 0xf0) == 0xe0) {
+	ch = p[0] & 0x0f;
+	n = 2;
+    } else if ((p[0] & 0xf8) == 0xf0) {
+	ch = p[0] & 0x07;
+	n = 3;
+    } else
+	return 0;
+
+    for (i = 1; i <= n; ++i) {
+	if ((p[i] & 0xc0) != 0x80)
+	    return 0;
+	ch = ch << 6 | (p[i] & 0x3f);
+    }
+    *s += n + 1;
+    return ch;
+}
+
+struct type_job {
+    int id;
+    int num_reports;
+    uint8_t (*reports)[8];
+    struct type_job* next;
+};
+
+static pthread_t type_tid;
+static int type_thread_running;
+static pthread_mutex_t type_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t type_cond = PTHREAD_COND_INITIALIZER;
+static struct type_job* type_queue;
+static int type_last_id;
+
+static void* _type_thread(void* arg)
+{
+    struct type_job* job;
+    int i, ret;
+
+    thread_policy_default();
+
+    for (;;) {
+	pthread_mutex_lock(&type_lock);
+	while (!type_queue)
+	    pthread_cond_wait(&type_cond, &type_lock);
+	job = type_queue;
+	type_queue = job->next;
+	pthread_mutex_unlock(&type_lock);
+
+	/* each write blocks until the host polled, so the lock is only taken
+	 * per report. Otherwise vnc key events would wait for the whole
+	 * string and with them the rfb event loop */
+	for (i = 0; i < job->num_reports; ++i) {
+	    pthread_mutex_lock(&hid_lock);
+	    ret = write(_fd, job->reports[i], 8);
+	    pthread_mutex_unlock(&hid_lock);
+	    PROBE2(hid_report, job->reports[i], ret);
+	    if (ret != 8) {
+		fprintf(stderr, "failed to write hid report: %m\n");
+		break;
+	    }
+	}
+	/* back to whatever the vnc client is holding down */
+	pthread_mutex_lock(&hid_lock);
+	write(_fd, &keystate, sizeof(keystate));
+	pthread_mutex_unlock(&hid_lock);
+
+	control_event("type %d %s", job->id, i == job->num_reports ? "done" : "failed");
+	free(job->reports);
+	free(job);
+    }
+
+    return NULL;
+}
+
+static void add_key(uint8_t (*reports)[8], int* n, uint8_t code, uint8_t mods)
+{
+    memset(reports[*n], 0, 8);
+    reports[*n][0] = mods;
+    reports[*n][2] = code;
+    memset(reports[*n + 1], 0, 8);
+    *n += 2;
+}
+
+/* returns the job id, 0 if the string can't be typed with the layout,
+ * -ENODEV without device or -ENOMEM */
+int usbhid_type(const char* layout, const char* text)
+{
+    int (*lookup)(uint32_t ch, uint8_t* code, uint8_t* mods) = NULL;
+    struct type_job* job;
+    struct type_job** tail;
+    const char* p;
+    int i, id;
+
+    if (_fd == -1)
+	return -ENODEV;
+
+    for (i = 0; i < DIMOF(layouts); ++i)
+	if (!strcmp(layouts[i].name, layout))
+	    lookup = layouts[i].lookup;
+    if (!lookup)
+	return 0;
+
+    job = calloc(1, sizeof(*job));
+    if (!job)
+	return -ENOMEM;
+    /* at most a key and a space for dead keys per byte, each down and up */
+    job->reports = malloc(strlen(text) * 4 * 8 + 8);
+    if (!job->reports) {
+	free(job);
+	return -ENOMEM;
+    }
+
+    for (p = text; *p; ) {
+	uint8_t code, mods;
+	uint32_t ch = utf8_next(&p);
+
+	if (!ch || !lookup(ch, &code, &mods)) {
+	    free(job->reports);
+	    free(job);
+	    return 0;
+	}
+	add_key(job->reports, &job->num_reports, code, mods & ~DEAD);
+	if (mods & DEAD)
+	    add_key(job->reports, &job->num_reports, 0x2c, 0);
+    }
+
+    pthread_mutex_lock(&type_lock);
+    id = job->id = ++type_last_id;
+    for (tail = &type_queue; *tail; tail = &(*tail)->next)
+	;
+    *tail = job;
+    if (!type_thread_running) {
+	pthread_create(&type_tid, NULL, _type_thread, NULL);
+	type_thread_running = 1;
+    }
+    pthread_cond_signal(&type_cond);
+    pthread_mutex_unlock(&type_lock);
+
+    return id;
 }
 
 void usbhid_close()
@@ -24,6 +24,7 @@
 
 int usbhid_init(const char* fn);
 void usbhid_handle_key(rfbBool down, rfbKeySym key, rfbClientPtr cl);
+int usbhid_type(const char* layout, const char* text);
 void usbhid_close();
 
 #endif